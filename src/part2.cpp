@@ -5,13 +5,44 @@ http://nehe.gamedev.net/tutorial/particle_engine_using_triangle_strips/21001/
 
 #include <iostream>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <map>
+#include <sstream>
+#include <fstream>
+#include <deque>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <cmath>
 #include <GL/glew.h>
 #include <GL/glut.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <malloc.h>
+#include <execinfo.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <unistd.h>
 #include "GLSLProgram.h"
 #include "GLSLSourceFileReader.h"
 #include "OBJFileReader.h"
@@ -52,6 +83,18 @@ struct Globals {
     cgtk::Trackball trackball;
     Mesh mesh;
     MeshVAO meshVAO;
+    cgtk::GLSLProgram *oitAccumProgram;
+    cgtk::GLSLProgram *oitCompositeProgram;
+    cgtk::GLSLProgram *blendProgram;
+    cgtk::GLSLProgram *trailProgram;
+    cgtk::GLSLProgram *sunProgram;
+    cgtk::GLSLProgram *brightProgram;
+    cgtk::GLSLProgram *bloomDownProgram;
+    cgtk::GLSLProgram *bloomUpProgram;
+    cgtk::GLSLProgram *tonemapProgram;
+    cgtk::GLSLProgram *minorPlanetProgram;
+    cgtk::GLSLProgram *starProgram;
+    cgtk::GLSLProgram *galacticBandProgram;
 };
 
 Globals globals;
@@ -71,76 +114,67 @@ GLUquadric *sun;
 //CONSTANTS
 const float PI = 3.14;
 
-//CAMERA
+//TEXTURES
+const int NUM_TEXTURES = 13;
+GLuint textures[NUM_TEXTURES];
+GLuint galacticBandTexture = 0; //Low-resolution copy of the Milky Way (9) for the star field.
+
+//File of each texture in the texture directory, by index.
+const char *textureFiles[NUM_TEXTURES] = {
+	"sun.png", "mercury.png", "venus.png", "earth.png", "mars.png", "jupiter.png", "saturn.png",
+	"uranus.png", "neptune.png", "MW.png", "Particle.png", "texture_earth_clouds.png",
+	"texture_venus_atmosphere.png",
+};
+
+//BODIES
+enum BodyId { SUN, MERCURY, VENUS, EARTH, MARS, JUPITER, SATURN, URANUS, NEPTUNE, NUM_BODIES };
+
+//Orbit and spin parameters of each body. The mean anomaly in degrees
+//advances by orbitSpeed * orbitScale per simulation step, the spin by
+//spinSpeed degrees per step (negative for retrograde rotation). The orbit
+//is an ellipse with semi-major axis orbitRadius, the given eccentricity
+//and the periapsis at longitude periapsis (degrees).
+struct BodyParams {
+	const char *name;
+	float orbitRadius;
+	float eccentricity;
+	float periapsis;
+	float orbitSpeed;
+	float orbitScale;
+	float spinSpeed;
+	float radius;
+	int texture;
+};
 
-float angle = 0.0;			 // Angle of rotation for the camera direction
-float lx = 0.0f, lz = -1.0f; // Direction of the camera.
-float x = 0.0f, z = 5.0f;	 // X and Z position for the camera.
+BodyParams bodies[NUM_BODIES] = {
+	{ "Sun",     0.0f,  0.000f,   0.0f, 0.00f, 0.00f,   0.00f, 3.0f,  0 },
+	{ "Mercury", 3.9f,  0.050f,  77.0f, 0.06f, 0.50f,   0.07f, 0.2f,  1 }, //Really 0.206, but the orbits are not to scale and Mercury would graze the Sun.
+	{ "Venus",   5.0f,  0.007f, 131.0f, 0.05f, 0.50f,  -0.03f, 0.25f, 2 }, //Venus' rotation is retrograde and the slowest in the solar system (243 Earth days).
+	{ "Earth",   8.0f,  0.017f, 102.0f, 0.07f, 0.30f,   0.20f, 0.3f,  3 },
+	{ "Mars",    11.0f, 0.093f, 336.0f, 0.09f, 0.30f,   0.22f, 0.27f, 4 }, //24.6 Earth hours.
+	{ "Jupiter", 15.0f, 0.049f,  14.0f, 0.10f, 0.30f,  35.00f, 0.7f,  5 }, //10 Earth hours. Fastest in the solar system.
+	{ "Saturn",  17.0f, 0.057f,  93.0f, 0.13f, 0.30f,  14.00f, 0.35f, 6 },
+	{ "Uranus",  19.0f, 0.046f, 173.0f, 0.15f, 0.30f,  10.00f, 0.2f,  7 },
+	{ "Neptune", 21.0f, 0.009f,  48.0f, 0.17f, 0.30f,  11.00f, 0.4f,  8 },
+};
 
-//TEXTURES
-GLuint textures[11];          //The size of the array corresponds to the number of textures.
-
-//ORBITS
-float orbitAroundSun = 0.0f;
-
-//MERCURY
-float mercury_x = 0.0f;
-float mercury_y = 0.0f;
-float mercuryOriginX = 0.0f;
-float mercuryOrbitAroundSun = 0.0f;
-float mercuryRotation = 0.0f;
-
-//VENUS
-float venus_x = 0.0f;
-float venus_y = 0.0f;
-float venusOriginX = 0.0f;
-float venusOrbitAroundSun = 0.0f;
-float venusRotation = 0;
-
-//EARTH
-float earth_x = 0.0f;
-float earth_y = 0.0f;
-float earthOriginX = 0.0f;
-float earthOrbitAroundSun = 0.0f;
-float earthRotation = 0;
-
-//MARS
-float mars_x = 0.0f;
-float mars_y = 0.0f;
-float marsOriginX = 0.0f;
-float marsOrbitAroundSun = 0.0f;
-float marsRotation = 0.0f;
-
-//JUPITER
-float jupiter_x = 0.0f;
-float jupiter_y = 0.0f;
-float jupiterOriginX = 0.0f;
-float jupiterOrbitAroundSun = 0.0f;
-float jupiterRotation = 0.0f;
-
-//SATURN
-float saturn_x = 0.0f;
-float saturn_y = 0.0f;
-float saturnOriginX = 0.0f;
-float saturnOrbitAroundSun = 0.0f;
-float saturnRotation = 0.0f;
-
-//URANUS
-float uranus_x = 0.0f;
-float uranus_y = 0.0f;
-float uranusOriginX = 0.0f;
-float uranusOrbitAroundSun = 0.0f;
-float uranusRotation = 0.0f;
-
-//NEPTUNE
-float neptune_x = 0.0f;
-float neptune_y = 0.0f;
-float neptuneOriginX = 0.0f;
-float neptuneOrbitAroundSun = 0.0f;
-float neptuneRotation = 0.0f;
+//Position on the orbit of a body for the given mean anomaly in degrees.
+//Solves Kepler's equation M = E - e sin(E) with a few Newton steps.
+glm::dvec3 orbitPosition(const BodyParams &body, double meanAnomaly)
+{
+	double e = body.eccentricity;
+	double M = meanAnomaly / 180.0 * PI;
+	double E = M;
+	for (int i = 0; i < 5; i++)
+		E -= (E - e * sin(E) - M) / (1.0 - e * cos(E));
+	double x = body.orbitRadius * (cos(E) - e);
+	double y = body.orbitRadius * sqrt(1.0 - e * e) * sin(E);
+	double w = body.periapsis / 180.0 * PI;
+	return glm::dvec3(x * cos(w) - y * sin(w), 0.0, x * sin(w) + y * cos(w));
+}
 
 //PARTICLES
-const int MAX_PARTICLES = 10; //Since the particles are based on spheres, rendering many of them will reduce performance.
+const int MAX_PARTICLES = 1000; //The particles are blended sprites, so they are cheap compared to the old spheres.
 
 float slowdown = 2.0f; //Slow down particles
 float particleXSpeed;
@@ -159,10 +193,907 @@ typedef struct
 	float yD;
 	float zD;
 	float horizontalMovement;
+	unsigned generation;    //Counts the respawns, see DrawItem::generation.
 }
 particles;
 
-particles particle[MAX_PARTICLES];
+//View frustum as six planes (a, b, c, d), inside if
+//a*x + b*y + c*z + d >= 0.
+struct Frustum {
+	float planes[6][4];
+};
+
+bool sphereInFrustum(const Frustum &frustum, const glm::vec3 &center, float radius)
+{
+	for (int i = 0; i < 6; i++)
+	{
+		const float *plane = frustum.planes[i];
+		if (plane[0] * center.x + plane[1] * center.y + plane[2] * center.z + plane[3] < -radius)
+			return false;
+	}
+	return true;
+}
+
+//SPATIAL INDEX
+//Bounding volume hierarchy over bounding spheres, used for picking and
+//radius queries. The nodes are stored depth first, so the left child of
+//a node directly follows it and every child comes after its parent; a
+//refit is a single backwards sweep. Each simulation step refits the
+//existing tree and only rebuilds it when the object count changes or
+//the refitted tree has become much worse than a fresh one.
+struct BVHNode {
+	float bmin[3];
+	float bmax[3];
+	int offset;      //Leaf: first entry in indices. Inner: right child.
+	int count;       //Leaf: number of objects. Inner: 0.
+};
+
+class SphereBVH {
+public:
+	SphereBVH() : numObjects(0), builtCost(0.0), cost(0.0) {}
+
+	int size(void) const { return numObjects; }
+
+	void build(const glm::vec3 *centers, const float *radii, int count)
+	{
+		numObjects = count;
+		nodes.clear();
+		indices.resize(count);
+		for (int i = 0; i < count; i++)
+			indices[i] = i;
+		if (count > 0)
+			buildNode(centers, radii, 0, count);
+		cost = builtCost = refit(centers, radii);
+	}
+
+	//Recomputes the node bounds for new positions. Returns the sum of the
+	//node surface areas, a cheap measure of the tree quality.
+	double refit(const glm::vec3 *centers, const float *radii)
+	{
+		double area = 0.0;
+		for (int n = (int)nodes.size() - 1; n >= 0; n--)
+		{
+			BVHNode &node = nodes[n];
+			if (node.count > 0)
+			{
+				for (int k = 0; k < 3; k++)
+				{
+					node.bmin[k] = 1e30f;
+					node.bmax[k] = -1e30f;
+				}
+				for (int i = node.offset; i < node.offset + node.count; i++)
+				{
+					const glm::vec3 &c = centers[indices[i]];
+					float r = radii[indices[i]];
+					for (int k = 0; k < 3; k++)
+					{
+						node.bmin[k] = std::min(node.bmin[k], c[k] - r);
+						node.bmax[k] = std::max(node.bmax[k], c[k] + r);
+					}
+				}
+			}
+			else
+			{
+				const BVHNode &a = nodes[n + 1], &b = nodes[node.offset];
+				for (int k = 0; k < 3; k++)
+				{
+					node.bmin[k] = std::min(a.bmin[k], b.bmin[k]);
+					node.bmax[k] = std::max(a.bmax[k], b.bmax[k]);
+				}
+			}
+			float dx = node.bmax[0] - node.bmin[0], dy = node.bmax[1] - node.bmin[1], dz = node.bmax[2] - node.bmin[2];
+			area += dx * dy + dy * dz + dz * dx;
+		}
+		cost = area;
+		return area;
+	}
+
+	//Refits, or rebuilds if the object count changed or the refitted tree
+	//costs 50% more than it did when it was built.
+	void update(const glm::vec3 *centers, const float *radii, int count)
+	{
+		if (count != numObjects || refit(centers, radii) > builtCost * 1.5)
+			build(centers, radii, count);
+	}
+
+	//Returns the nearest object hit by the ray, or -1. dir must be normalized.
+	int raycast(const glm::vec3 *centers, const float *radii, const glm::vec3 &origin,
+	            const glm::vec3 &dir, float *distance) const
+	{
+		int best = -1;
+		float bestT = 1e30f;
+		if (nodes.empty())
+			return -1;
+		glm::vec3 inv(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+		int stack[STACK_SIZE];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const BVHNode &node = nodes[stack[--top]];
+			if (rayBox(node, origin, inv) >= bestT)
+				continue;
+			if (node.count > 0)
+			{
+				for (int i = node.offset; i < node.offset + node.count; i++)
+				{
+					int object = indices[i];
+					glm::vec3 oc = origin - centers[object];
+					float b = glm::dot(oc, dir);
+					float c = glm::dot(oc, oc) - radii[object] * radii[object];
+					float h = b * b - c;
+					if (h < 0.0f)
+						continue;
+					float t = -b - sqrt(h);
+					if (t < 0.0f)
+						t = -b + sqrt(h); //Origin inside the sphere.
+					if (t >= 0.0f && t < bestT)
+					{
+						bestT = t;
+						best = object;
+					}
+				}
+				continue;
+			}
+			//Visit the nearer child first.
+			int near = (int)(&node - &nodes[0]) + 1, far = node.offset;
+			if (rayBox(nodes[near], origin, inv) > rayBox(nodes[far], origin, inv))
+				std::swap(near, far);
+			stack[top++] = far;
+			stack[top++] = near;
+		}
+		if (distance)
+			*distance = bestT;
+		return best;
+	}
+
+	//Appends every object whose sphere intersects the query sphere.
+	void queryRadius(const glm::vec3 *centers, const float *radii, const glm::vec3 &center,
+	                 float radius, std::vector<int> &out) const
+	{
+		if (nodes.empty())
+			return;
+		int stack[STACK_SIZE];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			int n = stack[--top];
+			const BVHNode &node = nodes[n];
+			float d2 = 0.0f;
+			for (int k = 0; k < 3; k++)
+			{
+				float v = std::max(node.bmin[k] - center[k], std::max(0.0f, center[k] - node.bmax[k]));
+				d2 += v * v;
+			}
+			if (d2 > radius * radius)
+				continue;
+			if (node.count > 0)
+			{
+				for (int i = node.offset; i < node.offset + node.count; i++)
+				{
+					float r = radius + radii[indices[i]];
+					glm::vec3 d = centers[indices[i]] - center;
+					if (glm::dot(d, d) <= r * r)
+						out.push_back(indices[i]);
+				}
+			}
+			else
+			{
+				stack[top++] = node.offset;
+				stack[top++] = n + 1;
+			}
+		}
+	}
+
+	//Culls the objects against up to eight frustums in one traversal: bit
+	//f of masks[object] is set if the object's sphere is inside frustum
+	//f. Subtrees completely inside a frustum are not tested against it
+	//again. The frustums must be in the same space as the centers.
+	void queryFrustums(const glm::vec3 *centers, const float *radii, const Frustum *frustums,
+	                   int count, unsigned char *masks) const
+	{
+		if (nodes.empty() || count == 0)
+			return;
+		struct Entry {
+			int node;
+			unsigned char active;  //Frustums the node may be in.
+			unsigned char inside;  //Frustums the node is completely in.
+		};
+		Entry stack[STACK_SIZE];
+		int top = 0;
+		stack[top].node = 0;
+		stack[top].active = (unsigned char)((1 << count) - 1);
+		stack[top].inside = 0;
+		top++;
+		while (top > 0)
+		{
+			Entry entry = stack[--top];
+			const BVHNode &node = nodes[entry.node];
+			for (int f = 0; f < count; f++)
+			{
+				unsigned char bit = (unsigned char)(1 << f);
+				if (!(entry.active & bit) || (entry.inside & bit))
+					continue;
+				int state = boxInFrustum(node, frustums[f]);
+				if (state < 0)
+					entry.active &= ~bit;
+				else if (state > 0)
+					entry.inside |= bit;
+			}
+			if (entry.active == 0)
+				continue;
+			if (node.count > 0)
+			{
+				for (int i = node.offset; i < node.offset + node.count; i++)
+				{
+					int object = indices[i];
+					unsigned char mask = entry.inside;
+					for (int f = 0; f < count; f++)
+					{
+						unsigned char bit = (unsigned char)(1 << f);
+						if ((entry.active & ~entry.inside & bit) &&
+						    sphereInFrustum(frustums[f], centers[object], radii[object]))
+							mask |= bit;
+					}
+					masks[object] |= mask;
+				}
+			}
+			else
+			{
+				Entry right = entry, left = entry;
+				right.node = node.offset;
+				left.node = entry.node + 1;
+				stack[top++] = right;
+				stack[top++] = left;
+			}
+		}
+	}
+
+private:
+	static const int LEAF_SIZE = 4;
+
+	//The traversals keep at most one pending sibling per level plus the
+	//root. The median split halves the objects at every level, so the depth
+	//is below the number of bits in the object count.
+	static const int STACK_SIZE = 64;
+	static_assert(STACK_SIZE >= 2 + 8 * (int)sizeof(int), "The traversal stack must fit the deepest tree.");
+
+	//-1 if the box is outside the frustum, 1 if it is completely inside,
+	//0 if it straddles a plane.
+	static int boxInFrustum(const BVHNode &node, const Frustum &frustum)
+	{
+		int result = 1;
+		for (int i = 0; i < 6; i++)
+		{
+			const float *plane = frustum.planes[i];
+			float nearest = plane[3], farthest = plane[3];
+			for (int k = 0; k < 3; k++)
+			{
+				float a = plane[k] * node.bmin[k], b = plane[k] * node.bmax[k];
+				nearest += std::min(a, b);
+				farthest += std::max(a, b);
+			}
+			if (farthest < 0.0f)
+				return -1;
+			if (nearest < 0.0f)
+				result = 0;
+		}
+		return result;
+	}
+
+	//Entry distance of the ray into the node, or 1e30 on a miss.
+	static float rayBox(const BVHNode &node, const glm::vec3 &origin, const glm::vec3 &inv)
+	{
+		float tmin = 0.0f, tmax = 1e30f;
+		for (int k = 0; k < 3; k++)
+		{
+			float t0 = (node.bmin[k] - origin[k]) * inv[k];
+			float t1 = (node.bmax[k] - origin[k]) * inv[k];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+		}
+		return (tmin <= tmax ? tmin : 1e30f);
+	}
+
+	//Median split on the longest axis of the centers.
+	int buildNode(const glm::vec3 *centers, const float *radii, int begin, int end)
+	{
+		int index = (int)nodes.size();
+		nodes.push_back(BVHNode());
+		if (end - begin <= LEAF_SIZE)
+		{
+			nodes[index].offset = begin;
+			nodes[index].count = end - begin;
+			return index;
+		}
+		glm::vec3 lo(1e30f), hi(-1e30f);
+		for (int i = begin; i < end; i++)
+		{
+			lo = glm::min(lo, centers[indices[i]]);
+			hi = glm::max(hi, centers[indices[i]]);
+		}
+		glm::vec3 extent = hi - lo;
+		int axis = (extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2));
+		int middle = (begin + end) / 2;
+		std::nth_element(indices.begin() + begin, indices.begin() + middle, indices.begin() + end,
+		                 [centers, axis](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+		buildNode(centers, radii, begin, middle);
+		int right = buildNode(centers, radii, middle, end);
+		nodes[index].offset = right;
+		nodes[index].count = 0;
+		return index;
+	}
+
+	std::vector<BVHNode> nodes;
+	std::vector<int> indices;
+	int numObjects;
+	double builtCost;
+	double cost;
+};
+
+//MEMORY
+//The global operator new and delete are replaced to count heap
+//allocations, in total and per thread, and the live heap size. The
+//profiler shows the allocations the GLUT thread makes per frame, which
+//should be zero once everything is warmed up: per-frame data goes into
+//the frame arena and recycled objects into pools. heapHook, if set, is
+//called for every allocation, e.g. to find where one comes from.
+std::atomic<long> heapAllocations(0);
+std::atomic<long long> heapLiveBytes(0);
+std::atomic<long long> heapPeakBytes(0);
+thread_local long threadHeapAllocations = 0;
+thread_local bool insideHeapHook = false;
+void (*heapHook)(size_t size) = NULL;
+
+void *operator new(size_t size)
+{
+	void *pointer = malloc(size ? size : 1);
+	if (pointer == NULL)
+		throw std::bad_alloc();
+	heapAllocations.fetch_add(1, std::memory_order_relaxed);
+	threadHeapAllocations++;
+	long long live = heapLiveBytes.fetch_add(malloc_usable_size(pointer), std::memory_order_relaxed) +
+	                 malloc_usable_size(pointer);
+	long long peak = heapPeakBytes.load(std::memory_order_relaxed);
+	while (live > peak && !heapPeakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+		;
+	if (heapHook != NULL && !insideHeapHook) {
+		insideHeapHook = true;
+		heapHook(size);
+		insideHeapHook = false;
+	}
+	return pointer;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept
+{
+	if (pointer == NULL)
+		return;
+	heapLiveBytes.fetch_sub(malloc_usable_size(pointer), std::memory_order_relaxed);
+	free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+	operator delete(pointer);
+}
+
+//The sized versions, used by C++14 compilers, must not bypass the above.
+void operator delete(void *pointer, size_t) noexcept
+{
+	operator delete(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept
+{
+	operator delete(pointer);
+}
+
+//Linear allocator for data that only lives during one frame on the GLUT
+//thread: allocation bumps an offset, reset() at the start of a frame
+//frees everything at once, and a Scope frees what was allocated in it.
+//Only for trivially destructible types, no destructors are run. What
+//does not fit goes to the heap for this frame, and the arena grows at
+//the next reset.
+class FrameArena {
+public:
+	FrameArena() : base(NULL), capacity(0), used(0), peak(0), overflowBytes(0) {}
+
+	void reserve(size_t bytes)
+	{
+		if (bytes <= capacity)
+			return;
+		::operator delete(base);
+		base = static_cast<char *>(::operator new(bytes));
+		capacity = bytes;
+	}
+
+	template <typename T>
+	T *allocate(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "The frame arena runs no destructors.");
+		size_t bytes = count * sizeof(T);
+		size_t offset = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+		if (offset + bytes > capacity) {
+			overflowBytes += bytes;
+			overflow.push_back(::operator new(bytes));
+			return static_cast<T *>(overflow.back());
+		}
+		used = offset + bytes;
+		peak = std::max(peak, used);
+		return reinterpret_cast<T *>(base + offset);
+	}
+
+	void reset(void)
+	{
+		if (!overflow.empty()) {
+			for (size_t i = 0; i < overflow.size(); i++)
+				::operator delete(overflow[i]);
+			overflow.clear();
+			reserve((peak + overflowBytes) * 2);
+			overflowBytes = 0;
+		}
+		used = 0;
+	}
+
+	size_t highWater(void) const { return peak; }
+
+	//Frees the allocations made during its lifetime.
+	struct Scope {
+		Scope(FrameArena &arena) : arena(arena), mark(arena.used) {}
+		~Scope() { arena.used = std::min(arena.used, mark); }
+		FrameArena &arena;
+		size_t mark;
+	};
+
+private:
+	char *base;
+	size_t capacity;
+	size_t used;
+	size_t peak;
+	size_t overflowBytes;
+	std::vector<void *> overflow;
+};
+
+FrameArena frameArena;
+
+//Heap allocations of the last complete frame, shown by the profiler.
+struct FrameAllocations {
+	FrameAllocations() : glutThread(0), total(0), traced(0) {}
+	long glutThread;  //Made by the GLUT thread during display().
+	long total;       //Made by all threads while display() ran.
+	int traced;
+};
+
+FrameAllocations frameAllocations;
+thread_local bool insideFrame = false;
+
+//heapHook for --trace-allocations: prints where the first allocations
+//the GLUT thread makes during a frame come from. backtrace() allocates
+//once when it is first used, which is why the hook is not reentered.
+void traceFrameAllocation(size_t size)
+{
+	const int MAX_TRACED = 20;
+	if (!insideFrame || frameAllocations.traced >= MAX_TRACED)
+		return;
+	frameAllocations.traced++;
+	void *frames[32];
+	int depth = backtrace(frames, 32);
+	fprintf(stderr, "Allocation of %zu bytes during a frame:\n", size);
+	backtrace_symbols_fd(frames, depth, STDERR_FILENO);
+}
+
+//Pool of objects that are created and destroyed all the time. Objects
+//are carved out of blocks that are never given back to the heap and
+//recycled through a free list, so once the pool has grown to its working
+//set, acquire() and release() do not allocate. Objects are default
+//initialized, i.e. plain members are left uninitialized. Not thread safe.
+template <typename T, int BLOCK = 64>
+class Pool {
+public:
+	Pool() : freeList(NULL), live(0) {}
+
+	T *acquire(void)
+	{
+		if (freeList == NULL)
+			grow();
+		Slot *slot = freeList;
+		freeList = slot->next;
+		live++;
+		return new (&slot->storage) T;
+	}
+
+	void release(T *object)
+	{
+		object->~T();
+		Slot *slot = reinterpret_cast<Slot *>(object);
+		slot->next = freeList;
+		freeList = slot;
+		live--;
+	}
+
+	size_t size(void) const { return live; }
+	size_t capacity(void) const { return blocks.size() * BLOCK; }
+
+private:
+	union Slot {
+		Slot *next;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	};
+
+	void grow(void)
+	{
+		Slot *block = static_cast<Slot *>(::operator new(sizeof(Slot) * BLOCK));
+		blocks.push_back(block);
+		for (int i = BLOCK - 1; i >= 0; i--) {
+			block[i].next = freeList;
+			freeList = &block[i];
+		}
+	}
+
+	Slot *freeList;
+	std::vector<Slot *> blocks;
+	size_t live;
+};
+
+//FRAME PIPELINE
+//The simulation of frame N+1 runs on the job system while the GLUT thread
+//draws frame N. The simulation writes a FrameState and hands it over to
+//the render thread through a lock-free triple buffer (FrameExchange).
+
+//One entry of the render list built by the simulation.
+struct DrawItem {
+	int texture;
+	glm::dvec3 position;
+	float tilt;        //Rotation around the X axis before the spin.
+	float rotation;    //Spin around the body's own axis, in degrees.
+	float radius;
+	float opacity;     //Only used by transparent items.
+	unsigned generation; //Changes when the object jumps instead of moving, which restarts its trail.
+};
+
+//Everything the render thread needs to draw one frame.
+struct FrameState {
+	long step;
+	double time;                           //Simulated time in steps.
+	glm::dvec3 position[NUM_BODIES];
+	float rotation[NUM_BODIES];
+	std::vector<DrawItem> drawList;
+	std::vector<DrawItem> shellList;       //Transparent atmosphere and cloud shells.
+	std::vector<DrawItem> spriteList;      //Transparent particle sprites.
+	//Bounding spheres of all pickable objects: the bodies, then the
+	//particles. The BVH over them is refitted every step.
+	std::vector<glm::vec3> boundsCenter;
+	std::vector<float> boundsRadius;
+	SphereBVH bvh;
+	double bvhMs;
+	double simulateMs;         //Time spent building this state.
+	double simulatedAt;        //When the simulation of this state started.
+};
+
+//World positions are kept in double precision. Everything is drawn
+//relative to renderOrigin (the camera), so that the float vertex data and
+//matrices stay small and precise even at astronomical distances.
+glm::dvec3 renderOrigin(0.0, 0.0, 0.0);
+
+glm::vec3 toRender(const glm::dvec3 &position)
+{
+	return glm::vec3(position - renderOrigin);
+}
+
+//State owned by the simulation job. Only one simulation step runs at a
+//time, so this is never touched concurrently.
+struct SimulationState {
+	SimulationState() : step(0), time(0.0), timeScale(1.0), epoch(0), seed(0) {}
+	long step;
+	double time;               //Simulated time in steps; advances by timeScale per step.
+	double timeScale;
+	unsigned epoch;            //Counts the seeks; the generation of the bodies.
+	unsigned int seed;         //rand() is not safe to call from the workers.
+	particles particle[MAX_PARTICLES];
+};
+
+SimulationState simulation;
+
+//Returns a monotonic time stamp in milliseconds.
+double nowMs(void)
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+//Clock of animations such as the camera flights. The video export sets
+//it to the time of the exported frame instead of the wall clock.
+double fixedClockMs = -1.0;
+
+double animationMs(void)
+{
+	return fixedClockMs >= 0.0 ? fixedClockMs : nowMs();
+}
+
+//Lock-free triple buffer. The producer fills writeSlot() and publishes it,
+//the consumer acquires the newest published slot. Neither side ever waits
+//for the other; the consumer keeps its slot if nothing new was published.
+template <typename T>
+class TripleBuffer {
+public:
+	TripleBuffer() : published(1), writing(0), reading(2) {}
+
+	T &writeSlot(void) { return slots[writing]; }
+	const T &readSlot(void) const { return slots[reading]; }
+
+	void publish(void)
+	{
+		writing = published.exchange(writing | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	//Returns true if a new frame was picked up.
+	bool acquire(void)
+	{
+		if ((published.load(std::memory_order_relaxed) & FRESH) == 0)
+			return false;
+		reading = published.exchange(reading, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+
+private:
+	static const int INDEX = 3;
+	static const int FRESH = 4;
+	T slots[3];
+	std::atomic<int> published;
+	int writing;                //Only touched by the producer.
+	int reading;                //Only touched by the consumer.
+};
+
+typedef TripleBuffer<FrameState> FrameExchange;
+
+//JOBS
+//Work-stealing thread pool. Every worker owns a deque: it pops its own
+//jobs from the back and steals from the front of the other deques when it
+//runs dry. Threads waiting on a job counter help by running jobs.
+class JobSystem {
+public:
+	typedef std::function<void()> Job;
+
+	JobSystem() : running(false), pending(0), next(0) {}
+
+	void start(int numWorkers)
+	{
+		running = true;
+		for (int i = 0; i < numWorkers; i++)
+			workers.push_back(new Worker());
+		for (int i = 0; i < numWorkers; i++)
+			workers[i]->thread = std::thread(&JobSystem::workerLoop, this, i);
+	}
+
+	void stop(void)
+	{
+		{
+			std::lock_guard<std::mutex> guard(sleepLock);
+			running = false;
+		}
+		wakeUp.notify_all();
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i]->thread.join();
+			delete workers[i];
+		}
+		workers.clear();
+	}
+
+	int numWorkers(void) const { return (int)workers.size(); }
+
+	//Queues a job. If counter is not NULL it is incremented now and
+	//decremented when the job has finished.
+	void submit(const Job &job, std::atomic<int> *counter)
+	{
+		if (counter)
+			counter->fetch_add(1);
+		Worker *worker = workers[next.fetch_add(1) % workers.size()];
+		{
+			std::lock_guard<std::mutex> guard(worker->lock);
+			worker->queue.pushBack(Task(job, counter));
+		}
+		pending.fetch_add(1);
+		wakeUp.notify_one();
+	}
+
+	//Runs queued jobs until counter reaches zero.
+	void wait(std::atomic<int> *counter)
+	{
+		while (counter->load() > 0) {
+			Task task;
+			if (steal(-1, &task))
+				run(task);
+			else
+				std::this_thread::yield();
+		}
+	}
+
+	//Splits [0, count) into chunks of at most grain items and runs
+	//body(begin, end) for each of them on the pool.
+	void parallelFor(int count, int grain, const std::function<void(int, int)> &body)
+	{
+		std::atomic<int> counter(0);
+		for (int begin = 0; begin < count; begin += grain) {
+			int end = std::min(begin + grain, count);
+			submit([&body, begin, end]() { body(begin, end); }, &counter);
+		}
+		wait(&counter);
+	}
+
+	//Total time the given worker has spent running jobs.
+	double busyMs(int worker) const
+	{
+		return workers[worker]->busyNs.load(std::memory_order_relaxed) / 1.0e6;
+	}
+
+private:
+	struct Task {
+		Task() : counter(NULL) {}
+		Task(const Job &job, std::atomic<int> *counter) : job(job), counter(counter) {}
+		Job job;
+		std::atomic<int> *counter;
+	};
+
+	//Double-ended queue of tasks in a ring buffer. Unlike std::deque it
+	//does not allocate as tasks come and go, only when it has to grow.
+	class TaskRing {
+	public:
+		TaskRing() : tasks(256), head(0), count(0) {}
+		bool empty(void) const { return count == 0; }
+
+		void pushBack(const Task &task)
+		{
+			if (count == tasks.size())
+				grow();
+			tasks[(head + count) & (tasks.size() - 1)] = task;
+			count++;
+		}
+
+		void popBack(Task *task)
+		{
+			count--;
+			take(&tasks[(head + count) & (tasks.size() - 1)], task);
+		}
+
+		void popFront(Task *task)
+		{
+			take(&tasks[head], task);
+			head = (head + 1) & (tasks.size() - 1);
+			count--;
+		}
+
+	private:
+		//Moves the task out and clears the slot, so that it does not keep
+		//the captures of a finished job alive.
+		static void take(Task *slot, Task *task)
+		{
+			*task = *slot;
+			*slot = Task();
+		}
+
+		void grow(void)
+		{
+			std::vector<Task> bigger(tasks.size() * 2);
+			for (size_t i = 0; i < count; i++)
+				bigger[i] = tasks[(head + i) & (tasks.size() - 1)];
+			tasks.swap(bigger);
+			head = 0;
+		}
+
+		std::vector<Task> tasks;  //The size is a power of two.
+		size_t head;
+		size_t count;
+	};
+
+	struct Worker {
+		Worker() : busyNs(0) {}
+		TaskRing queue;
+		std::mutex lock;
+		std::thread thread;
+		std::atomic<long long> busyNs;
+	};
+
+	//Takes a job from the back of the own deque, or from the front of
+	//another one. self is -1 for threads outside the pool.
+	bool steal(int self, Task *task)
+	{
+		if (pending.load() == 0)
+			return false;
+		int count = (int)workers.size();
+		for (int i = 0; i < count; i++) {
+			int victim = (self < 0 ? i : (self + i) % count);
+			Worker *worker = workers[victim];
+			std::lock_guard<std::mutex> guard(worker->lock);
+			if (worker->queue.empty())
+				continue;
+			if (victim == self)
+				worker->queue.popBack(task);
+			else
+				worker->queue.popFront(task);
+			pending.fetch_sub(1);
+			return true;
+		}
+		return false;
+	}
+
+	void run(Task &task)
+	{
+		task.job();
+		if (task.counter)
+			task.counter->fetch_sub(1);
+	}
+
+	void workerLoop(int self)
+	{
+		Worker *worker = workers[self];
+		while (true) {
+			Task task;
+			if (steal(self, &task)) {
+				double start = nowMs();
+				run(task);
+				worker->busyNs.fetch_add((long long)((nowMs() - start) * 1.0e6), std::memory_order_relaxed);
+				continue;
+			}
+			std::unique_lock<std::mutex> guard(sleepLock);
+			if (!running)
+				return;
+			wakeUp.wait_for(guard, std::chrono::milliseconds(2),
+			                [this]() { return !running || pending.load() > 0; });
+		}
+	}
+
+	std::vector<Worker *> workers;
+	bool running;
+	std::atomic<int> pending;
+	std::atomic<unsigned int> next;
+	std::mutex sleepLock;
+	std::condition_variable wakeUp;
+};
+
+JobSystem jobs;
+FrameExchange frameExchange;
+std::atomic<bool> simulationInFlight(false);
+
+//PROFILER
+//Named timings and counters, shown as a text overlay (hidden until toggled
+//with 'p').
+//Only the GLUT thread writes to it. The entries are kept sorted by name
+//in a vector; only adding a new name allocates.
+struct Profiler {
+	struct Entry {
+		char name[32];
+		double value;
+	};
+
+	Profiler() : visible(false), lastSample(0.0) {}
+	bool visible;
+	double lastSample;
+	std::vector<double> lastBusyMs;
+	std::vector<Entry> values;
+
+	void set(const char *name, double value)
+	{
+		std::vector<Entry>::iterator it = std::lower_bound(values.begin(), values.end(), name,
+			[](const Entry &entry, const char *key) { return strcmp(entry.name, key) < 0; });
+		if (it == values.end() || strcmp(it->name, name) != 0) {
+			Entry entry;
+			snprintf(entry.name, sizeof(entry.name), "%s", name);
+			it = values.insert(it, entry);
+		}
+		it->value = value;
+	}
+};
+
+Profiler profiler;
 
 // Returns the value of the environment variable whose name is
 // specified by the argument.
@@ -178,11 +1109,15 @@ std::string getEnvVar(const std::string &name)
 }
 
 // Returns the absolute path to the shader directory.
-// std::string shaderDir(void)
-// {
-
-//     return "shaders/";
-// }
+std::string shaderDir(void)
+{
+    std::string rootDir = getEnvVar("ASSIGNMENT3_ROOT");
+    if (rootDir.empty()) {
+        std::cout << "Error: ASSIGNMENT3_ROOT is not set." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return rootDir + "/src/shaders/";
+}
 
 std::string modelDir(void)
 {
@@ -206,22 +1141,27 @@ std::string textureDir(void)
     return rootDir + "/Textures/";
 }
 
-Image_t loadPNG(std::string const& filename)
+// Decodes a PNG file. Returns false on errors.
+bool decodePNG(std::string const& filename, Image_t *image)
 {
-    std::cout << "Loading image from " << filename << " ..." << std::endl;  
-
-    std::vector<unsigned char> data;
     unsigned width, height;
-    unsigned error = lodepng::decode(data, width, height, filename);
+    unsigned error = lodepng::decode(image->data, width, height, filename);
     if (error != 0) {
-        std::cout << "Error: " << lodepng_error_text(error) << std::endl;
-        exit(EXIT_FAILURE);
+        std::cout << "Error: " << filename << ": " << lodepng_error_text(error) << std::endl;
+        return false;
     }
-  
+    image->width = width;
+    image->height = height;
+    return true;
+}
+
+Image_t loadPNG(std::string const& filename)
+{
+    std::cout << "Loading image from " << filename << " ..." << std::endl;  
+
     Image_t image;
-    image.width = width;
-    image.height = height;
-    image.data = data;
+    if (!decodePNG(filename, &image))
+        exit(EXIT_FAILURE);
   
     std::cout << "Done!" << std::endl;
     std::cout << "Image width: " << image.width << std::endl;
@@ -231,53 +1171,48 @@ Image_t loadPNG(std::string const& filename)
     return image;
 }
 
-void LoadTextures(std::string const& dirname)
+//Box-filters the Milky Way panorama down by 8 into the galactic band
+//texture, which blurs its baked-in stars into the unresolved glow.
+void createGalacticBand(const Image_t &image)
 {
-	glGenTextures(11, textures); //Create the space for the textures.
-	
-	glBindTexture(GL_TEXTURE_2D, textures[0]);
-	Image_t sun = loadPNG(std::string(dirname + "/sun.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1024, 512, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(sun.data[0]));  
+	const int factor = 8;
+	int width = std::max(1, (int)image.width / factor), height = std::max(1, (int)image.height / factor);
+	std::vector<unsigned char> data(width * height * 4);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			for (int c = 0; c < 4; c++) {
+				int sum = 0, n = 0;
+				for (int dy = 0; dy < factor && y * factor + dy < (int)image.height; dy++)
+					for (int dx = 0; dx < factor && x * factor + dx < (int)image.width; dx++, n++)
+						sum += image.data[((y * factor + dy) * image.width + x * factor + dx) * 4 + c];
+				data[(y * width + x) * 4 + c] = sum / std::max(n, 1);
+			}
+	if (galacticBandTexture == 0)
+		glGenTextures(1, &galacticBandTexture);
+	glBindTexture(GL_TEXTURE_2D, galacticBandTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8_ALPHA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &data[0]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
 
-	glBindTexture(GL_TEXTURE_2D, textures[1]);
-	Image_t mercury = loadPNG(std::string(dirname + "/mercury.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1024, 512, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(mercury.data[0]));  
-
-	glBindTexture(GL_TEXTURE_2D, textures[2]);
-	Image_t venus = loadPNG(std::string(dirname + "/venus.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1024, 512, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(venus.data[0]));  
-
-	glBindTexture(GL_TEXTURE_2D, textures[3]);
-	Image_t earth = loadPNG(std::string(dirname + "/earth.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1024, 512, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(earth.data[0])); 
-
-	glBindTexture(GL_TEXTURE_2D, textures[4]);
-	Image_t mars = loadPNG(std::string(dirname + "/mars.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1024, 512, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(mars.data[0]));  
-
-	glBindTexture(GL_TEXTURE_2D, textures[5]);
-	Image_t jupiter = loadPNG(std::string(dirname + "/jupiter.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1024, 512, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(jupiter.data[0]));  
-
-	glBindTexture(GL_TEXTURE_2D, textures[6]);
-	Image_t saturn = loadPNG(std::string(dirname + "/saturn.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1024, 512, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(saturn.data[0]));  
-
-	glBindTexture(GL_TEXTURE_2D, textures[7]);
-	Image_t uranus = loadPNG(std::string(dirname + "/uranus.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1024, 512, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(uranus.data[0]));  
-
-	glBindTexture(GL_TEXTURE_2D, textures[8]);
-	Image_t neptune = loadPNG(std::string(dirname + "/neptune.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1024, 512, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(neptune.data[0]));
-
-	glBindTexture(GL_TEXTURE_2D, textures[9]);
-	Image_t MW = loadPNG(std::string(dirname + "/MW.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1280, 640, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(MW.data[0]));
+void uploadTexture(int texture, const Image_t &image)
+{
+	glBindTexture(GL_TEXTURE_2D, textures[texture]);
+	//The images are sRGB encoded; let the GPU linearize them for the HDR
+	//pipeline.
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8_ALPHA8, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(image.data[0]));
+	if (texture == 9)
+		createGalacticBand(image);
+}
 
-	glBindTexture(GL_TEXTURE_2D, textures[10]);
-	Image_t Particle = loadPNG(std::string(dirname + "/Particle.png"));
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 32, 32, 0, GL_RGBA, GL_UNSIGNED_BYTE, &(Particle.data[0]));
+void LoadTextures(std::string const& dirname)
+{
+	glGenTextures(NUM_TEXTURES, textures); //Create the space for the textures.
+	for (int i = 0; i < NUM_TEXTURES; i++)
+		uploadTexture(i, loadPNG(dirname + "/" + textureFiles[i]));
 }
 
 void initGLEW(void)
@@ -294,9 +1229,10 @@ void displayOpenGLVersion(void)
     std::cout << "OpenGL version: " << glGetString(GL_VERSION) << std::endl;
 }
 
-void createShaderProgram(const std::string &vertexShaderFilename,
-                         const std::string &fragmentShaderFilename,
-                         cgtk::GLSLProgram *program)
+// Compiles and links a program. Returns false on errors.
+bool compileShaderProgram(const std::string &vertexShaderFilename,
+                          const std::string &fragmentShaderFilename,
+                          cgtk::GLSLProgram *program)
 {
     cgtk::GLSLSourceFileReader glslReader;
     glslReader.read(vertexShaderFilename.c_str());
@@ -305,10 +1241,48 @@ void createShaderProgram(const std::string &vertexShaderFilename,
     std::string fragmentShaderSource = glslReader.getSourceString();
 
     program->create(vertexShaderSource, fragmentShaderSource);
-    if (!program->isProgram() || !program->isValid()) {
+    return program->isProgram() && program->isValid();
+}
+
+// Shader files of each program, so that they can be recompiled when the
+// files change. program points to the global that holds the program, so
+// that a reload can install a new program object.
+struct ShaderProgramSource {
+    cgtk::GLSLProgram **program;
+    std::string vertexShaderFilename;
+    std::string fragmentShaderFilename;
+};
+
+std::vector<ShaderProgramSource> shaderPrograms;
+
+// Deletes a program object together with its GL program. Whether the
+// GLSLProgram destructor deletes the GL program is not specified, so the
+// handle is looked up first and deleted if it is still there. A program
+// that did not link can not be enabled; its handle reads as 0.
+void deleteShaderProgram(cgtk::GLSLProgram *program)
+{
+    GLint previous, handle;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &previous);
+    glUseProgram(0);
+    program->enable();
+    glGetIntegerv(GL_CURRENT_PROGRAM, &handle);
+    glUseProgram(previous);
+    delete program;
+    if (handle != 0 && glIsProgram(handle))
+        glDeleteProgram(handle);
+}
+
+void createShaderProgram(const std::string &vertexShaderFilename,
+                         const std::string &fragmentShaderFilename,
+                         cgtk::GLSLProgram **program)
+{
+    *program = new cgtk::GLSLProgram;
+    if (!compileShaderProgram(vertexShaderFilename, fragmentShaderFilename, *program)) {
         std::cerr << "Error: Could not create program." << std::endl;
         exit(EXIT_FAILURE);
     }
+    ShaderProgramSource source = { program, vertexShaderFilename, fragmentShaderFilename };
+    shaderPrograms.push_back(source);
 }
 
 void loadMesh(const std::string &filename, Mesh *mesh)
@@ -417,339 +1391,3626 @@ void drawMesh(cgtk::GLSLProgram &program, const MeshVAO &meshVAO)
     program.disable();
 }
 
-//Draw each one of the astronomical objects.
-void drawSun(void)
+//RESOLUTION GOVERNOR
+//Keeps the frame time under a target by trading quality for speed. The
+//scene is rendered into a target scaled down from the window size (the
+//tonemap pass upscales it) and the sphere tessellation, particle count
+//and star counts and terrain error threshold follow a ladder of quality levels. The cost
+//of a frame is the larger of its CPU submit time and its GPU time, so
+//the measurement does not saturate at the vsync interval.
+struct QualityLevel {
+	float scale;          //Scene resolution relative to the window.
+	int sphereSlices;     //Slices and stacks of the body spheres.
+	float particles;      //Fraction of the particle sprites drawn.
+	float stars;          //Fraction of the catalog stars drawn, brightest first.
+	float terrainError;   //Terrain split threshold in pixels.
+};
+
+const QualityLevel qualityLevels[] = {
+	{ 1.0f,   45, 1.0f,  1.0f,  2.0f },
+	{ 0.875f, 36, 0.75f, 1.0f,  3.0f },
+	{ 0.75f,  30, 0.5f,  0.5f,  4.0f },
+	{ 0.625f, 24, 0.35f, 0.35f, 6.0f },
+	{ 0.5f,   16, 0.25f, 0.25f, 8.0f },
+};
+const int NUM_QUALITY_LEVELS = sizeof(qualityLevels) / sizeof(qualityLevels[0]);
+
+struct Governor {
+	Governor() : enabled(true), targetMs(16.6), level(0), settle(0), samples(0), logPath("governor.log") {}
+	bool enabled;
+	double targetMs;
+	int level;
+	int settle;                 //Frames to wait before the next decision.
+	static const int WINDOW = 30;
+	double window[WINDOW];      //Rolling frame costs, a ring buffer.
+	int samples;                //Valid entries in window.
+	std::string logPath;
+	std::ofstream log;
+};
+
+Governor governor;
+
+const QualityLevel &quality(void)
 {
-	glActiveTexture(GL_TEXTURE0);
-    glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[0]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glPushMatrix();
-	glTranslatef(0,0,0);
-	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(90,1.0f,0.0f,0.0f);
-	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 3, 45, 45);
-	glPopMatrix();
-    glDisable(GL_TEXTURE_2D);
+	return qualityLevels[governor.enabled ? governor.level : 0];
 }
 
-void drawMercury(void)
+void logGovernor(const char *decision, double averageMs, double worstMs)
 {
-	mercury_x = 3.9f * cos(mercuryOrbitAroundSun * 0.50f / 180.0 * PI);
-	mercury_y = 3.9f * sin(mercuryOrbitAroundSun * 0.50f / 180.0 * PI);
+	if (!governor.log.is_open()) {
+		governor.log.open(governor.logPath.c_str());
+		governor.log << "time_ms,decision,average_ms,worst_ms,target_ms,level,scale,sphere_slices,particles,stars,terrain_error" << std::endl;
+	}
+	const QualityLevel &q = qualityLevels[governor.level];
+	governor.log << (long)nowMs() << "," << decision << "," << averageMs << "," << worstMs << ","
+	             << governor.targetMs << "," << governor.level << "," << q.scale << "," << q.sphereSlices << ","
+	             << q.particles << "," << q.stars << "," << q.terrainError << std::endl;
+}
 
-	if(mercuryOrbitAroundSun == 0)
-		mercuryOriginX = mercury_x;
-	if(mercury_x >= mercuryOriginX)
-		mercuryOrbitAroundSun = 0.0f;
-	glActiveTexture(GL_TEXTURE0);
-    glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[1]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+//Feeds the cost of the last frame. Steps down a level when the rolling
+//average is over the target, and back up when there is clear headroom.
+//After each step the window is refilled before deciding again, so the
+//effect of the step is what gets measured.
+void updateGovernor(double frameMs)
+{
+	if (!governor.enabled)
+		return;
+	governor.window[governor.samples % Governor::WINDOW] = frameMs;
+	governor.samples++;
+	if (governor.settle > 0) {
+		governor.settle--;
+		return;
+	}
+	if (governor.samples < Governor::WINDOW)
+		return;
+
+	double sum = 0.0, worst = 0.0;
+	for (int i = 0; i < Governor::WINDOW; i++) {
+		sum += governor.window[i];
+		worst = std::max(worst, governor.window[i]);
+	}
+	double average = sum / Governor::WINDOW;
+	profiler.set("governor average ms", average);
+
+	const char *decision = NULL;
+	if (average > governor.targetMs * 1.05 && governor.level < NUM_QUALITY_LEVELS - 1) {
+		governor.level++;
+		decision = "down";
+	}
+	//Going up costs more than the step down saved, so wait for a margin.
+	else if (average < governor.targetMs * 0.7 && governor.level > 0) {
+		governor.level--;
+		decision = "up";
+	}
+	if (decision != NULL) {
+		logGovernor(decision, average, worst);
+		governor.samples = 0;
+		governor.settle = Governor::WINDOW / 2;
+	}
+}
+
+//RENDER TARGETS
+//Offscreen HDR framebuffer the scene is drawn into, so that later passes
+//(transparency, bloom) can read its color and depth.
+struct RenderTarget {
+    GLuint fbo;
+    GLuint color;
+    GLuint depth;
+    int width;
+    int height;
+};
+
+RenderTarget sceneTarget = { 0, 0, 0, 0, 0 };
+
+GLuint createTargetTexture(GLint internalFormat, GLenum format, GLenum type, int width, int height)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glPushMatrix();
-	glTranslatef(mercury_x, 0, mercury_y);
-	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(90,1.0f,0.0f,0.0f);
-    glRotatef(mercuryRotation,0.0f,0.0f,1.0f);
-	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 0.2, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
-	glPopMatrix();
-    glDisable(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
 }
 
-void drawVenus(void)
+void checkFramebuffer(const char *name)
 {
-	venus_x = 5.0f * cos(venusOrbitAroundSun * 0.50f / 180.0 * PI);
-	venus_y = 5.0f * sin(venusOrbitAroundSun * 0.50f / 180.0 * PI);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Error: " << name << " framebuffer is incomplete (0x"
+                  << std::hex << status << std::dec << ")." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
 
-	if(venusOrbitAroundSun == 0)
-		venusOriginX = venus_x;
-	if(venus_x >= venusOriginX)
-		venusOrbitAroundSun = 0.0f;
-	glActiveTexture(GL_TEXTURE0);
-    glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[2]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glPushMatrix();
-	glTranslatef(venus_x, 0, venus_y);
-	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(90,1.0f,0.0f,0.0f);
-    glRotatef(-venusRotation,0.0f,0.0f,1.0f); //Venus rotation is retrograded.
-	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 0.25, 45, 45); 
-	glPopMatrix();
-    glDisable(GL_TEXTURE_2D);
+// (Re)creates the scene target if the requested size has changed.
+void resizeSceneTarget(RenderTarget *target, int width, int height)
+{
+    if (target->fbo != 0 && target->width == width && target->height == height)
+        return;
+    if (target->fbo != 0) {
+        glDeleteFramebuffers(1, &target->fbo);
+        glDeleteTextures(1, &target->color);
+        glDeleteTextures(1, &target->depth);
+    }
+    target->width = width;
+    target->height = height;
+    target->color = createTargetTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT, width, height);
+    target->depth = createTargetTexture(GL_DEPTH_COMPONENT32F, GL_DEPTH_COMPONENT, GL_FLOAT, width, height);
+
+    glGenFramebuffers(1, &target->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target->color, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, target->depth, 0);
+    checkFramebuffer("Scene");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-void drawEarth(void)
+// Draws a full-screen triangle (see fullscreen.vert).
+void drawFullscreenTriangle(void)
 {
-	//Earth rotation around the Sun.
-	 earth_x = 8.0f * cos(earthOrbitAroundSun * 0.30f / 180.0 * PI);
-	 earth_y = 8.0f * sin(earthOrbitAroundSun * 0.30f / 180.0 * PI);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
 
-	 if(earthOrbitAroundSun == 0)
-		 earthOriginX = earth_x;
-	 if(earth_x >= earthOriginX)
-		 earthOrbitAroundSun = 0.0f;
-	//GLUquadricObj* q = gluNewQuadric();
-   //glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT ); 
-	//gluQuadricNormals(q, GLU_SMOOTH);		
-	//gluQuadricTexture(q, GL_TRUE);
-	//glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+//TRANSPARENCY
+//Weighted blended order-independent transparency. Transparent surfaces
+//are accumulated in any order into an RGBA16F target (weighted color and
+//weight) and an R16F revealage target, then resolved over the scene in a
+//single full-screen pass. No per-frame sort of the transparent items.
+struct OITTarget {
+    GLuint fbo;
+    GLuint accum;
+    GLuint reveal;
+    int width;
+    int height;
+};
 
+OITTarget oitTarget = { 0, 0, 0, 0, 0 };
 
-    //glMatrixMode(GL_MODELVIEW);
-    //glLoadIdentity();
-	glActiveTexture(GL_TEXTURE0);
-    glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[3]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+// The OIT target shares the depth texture of the scene target, so that
+// transparent surfaces are hidden behind opaque ones.
+void resizeOITTarget(OITTarget *target, const RenderTarget &scene)
+{
+    if (target->fbo != 0 && target->width == scene.width && target->height == scene.height)
+        return;
+    if (target->fbo != 0) {
+        glDeleteFramebuffers(1, &target->fbo);
+        glDeleteTextures(1, &target->accum);
+        glDeleteTextures(1, &target->reveal);
+    }
+    target->width = scene.width;
+    target->height = scene.height;
+    target->accum = createTargetTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT, scene.width, scene.height);
+    target->reveal = createTargetTexture(GL_R16F, GL_RED, GL_FLOAT, scene.width, scene.height);
+
+    glGenFramebuffers(1, &target->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target->accum, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, target->reveal, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, scene.depth, 0);
+    GLenum buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, buffers);
+    checkFramebuffer("OIT");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Location of a uniform in the current program, looked up again only when
+// the program changes (another program or a hot reload). The cgtk setters
+// take a std::string, which allocates for names longer than 15 characters.
+struct UniformLocation {
+    UniformLocation() : program(0), location(-1) {}
+    GLint program;
+    GLint location;
+};
+
+GLint uniformLocation(UniformLocation *cache, const char *name)
+{
+    GLint current;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &current);
+    if (current != cache->program) {
+        cache->program = current;
+        cache->location = glGetUniformLocation(current, name);
+    }
+    return cache->location;
+}
+
+void bindTransparentTexture(cgtk::GLSLProgram &program, int texture)
+{
+    static UniformLocation alphaFromLuminanceLocation;
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, textures[texture]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glPushMatrix(); //Enter Earth's frame of reference.
-	glTranslatef(earth_x,0,earth_y);
-	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(90,1.0f,0.0f,0.0f);
-    glRotatef(earthRotation ,0.0f,0.0f,1.0f);
-	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 0.3, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
-	glPopMatrix(); //Exist Earth's frame of reference.
-    glDisable(GL_TEXTURE_2D);
+    program.setUniform1i("u_texture", 0);
+    //None of the shipped textures has an alpha channel.
+    glUniform1f(uniformLocation(&alphaFromLuminanceLocation, "u_alphaFromLuminance"), 1.0f);
+}
+
+// Draws the transparent shells with the given (already enabled) program.
+// With a mask, only the shells whose mask has one of the bits are drawn.
+void drawShells(cgtk::GLSLProgram &program, const std::vector<DrawItem> &shells,
+                const unsigned char *mask, unsigned char bits)
+{
+    for (size_t i = 0; i < shells.size(); i++) {
+        if (mask && !(mask[i] & bits))
+            continue;
+        const DrawItem &item = shells[i];
+        bindTransparentTexture(program, item.texture);
+        glColor4f(1.0f, 1.0f, 1.0f, item.opacity);
+        glPushMatrix();
+        glm::vec3 position = toRender(item.position);
+        glTranslatef(position.x, position.y, position.z);
+        glRotatef(7,1.0f,0.0f,0.0f);
+        glRotatef(item.tilt,1.0f,0.0f,0.0f);
+        glRotatef(item.rotation,0.0f,0.0f,1.0f);
+        gluQuadricTexture(sun, 1);
+        gluSphere(sun, item.radius, quality().sphereSlices, quality().sphereSlices);
+        glPopMatrix();
+    }
+    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+}
+
+// Vertex of a camera-facing sprite quad.
+struct SpriteVertex {
+    glm::vec3 position;
+    glm::vec2 texcoord;
+    GLfloat opacity[4];
+};
+
+// Expands the sprites to camera-facing quads and draws them in one call.
+// All sprites share the texture of the first one; the opacity goes into
+// the vertex color. With a mask, only the sprites whose mask has one of
+// the bits are drawn.
+void drawSprites(cgtk::GLSLProgram &program, const DrawItem *sprites, size_t count,
+                 const unsigned char *mask, unsigned char bits)
+{
+    if (count == 0)
+        return;
+
+    // The camera right and up vectors are the first two rows of the
+    // modelview rotation.
+    GLfloat mv[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+    glm::vec3 right(mv[0], mv[4], mv[8]);
+    glm::vec3 up(mv[1], mv[5], mv[9]);
+
+    FrameArena::Scope scope(frameArena);
+    SpriteVertex *vertices = frameArena.allocate<SpriteVertex>(count * 4);
+    size_t drawn = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (mask && !(mask[i] & bits))
+            continue;
+        const DrawItem &item = sprites[i];
+        glm::vec3 r = right * item.radius;
+        glm::vec3 u = up * item.radius;
+        glm::vec3 p = toRender(item.position);
+        SpriteVertex *v = &vertices[drawn++ * 4];
+        v[0].position = p - r - u; v[0].texcoord = glm::vec2(0.0f, 0.0f);
+        v[1].position = p + r - u; v[1].texcoord = glm::vec2(1.0f, 0.0f);
+        v[2].position = p + r + u; v[2].texcoord = glm::vec2(1.0f, 1.0f);
+        v[3].position = p - r + u; v[3].texcoord = glm::vec2(0.0f, 1.0f);
+        for (int k = 0; k < 4; k++) {
+            v[k].opacity[0] = v[k].opacity[1] = v[k].opacity[2] = 1.0f;
+            v[k].opacity[3] = item.opacity;
+        }
+    }
+
+    if (drawn == 0)
+        return;
+
+    bindTransparentTexture(program, sprites[0].texture);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(SpriteVertex), &vertices[0].position);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(SpriteVertex), &vertices[0].texcoord);
+    glColorPointer(4, GL_FLOAT, sizeof(SpriteVertex), vertices[0].opacity);
+    glDrawArrays(GL_QUADS, 0, (GLsizei)(drawn * 4));
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+// Accumulates the transparent items into the OIT target and resolves
+// them over the scene target. Expects the scene matrices to be set. Only
+// touches the viewport (and the scissor rectangle if it is enabled), so
+// each view can be resolved on its own. The masks select the items as in
+// drawShells() and drawSprites().
+void drawTransparentOIT(const std::vector<DrawItem> &shells, const unsigned char *shellMask,
+                        const DrawItem *sprites, size_t numSprites, const unsigned char *spriteMask,
+                        unsigned char bits)
+{
+    resizeOITTarget(&oitTarget, sceneTarget);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, oitTarget.fbo);
+    static const GLfloat zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    static const GLfloat one[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    glClearBufferfv(GL_COLOR, 0, zero);
+    glClearBufferfv(GL_COLOR, 1, one);
+
+    glDepthMask(GL_FALSE);
+    glEnable(GL_BLEND);
+    glBlendFunci(0, GL_ONE, GL_ONE);
+    glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+
+    globals.oitAccumProgram->enable();
+    drawShells(*globals.oitAccumProgram, shells, shellMask, bits);
+    drawSprites(*globals.oitAccumProgram, sprites, numSprites, spriteMask, bits);
+    globals.oitAccumProgram->disable();
+
+    // Resolve over the opaque scene
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneTarget.fbo);
+    glDisable(GL_DEPTH_TEST);
+    glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+    globals.oitCompositeProgram->enable();
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, oitTarget.accum);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, oitTarget.reveal);
+    globals.oitCompositeProgram->setUniform1i("u_accum", 0);
+    globals.oitCompositeProgram->setUniform1i("u_reveal", 1);
+    drawFullscreenTriangle();
+    globals.oitCompositeProgram->disable();
+    glActiveTexture(GL_TEXTURE0);
+
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    glDepthMask(GL_TRUE);
+}
+
+// Reference path for the benchmark: sorts the sprites back to front on
+// the CPU and draws them with ordinary alpha blending.
+double drawTransparentSorted(std::vector<DrawItem> &sprites)
+{
+    GLfloat mv[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+    glm::vec3 forward(mv[2], mv[6], mv[10]);
+
+    double sortStart = nowMs();
+    std::sort(sprites.begin(), sprites.end(),
+              [&forward](const DrawItem &a, const DrawItem &b) {
+                  return glm::dot(toRender(a.position), forward) < glm::dot(toRender(b.position), forward);
+              });
+    double sortMs = nowMs() - sortStart;
+
+    glDepthMask(GL_FALSE);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    globals.blendProgram->enable();
+    drawSprites(*globals.blendProgram, &sprites[0], sprites.size(), NULL, 0);
+    globals.blendProgram->disable();
+    glDisable(GL_BLEND);
+    glDepthMask(GL_TRUE);
+    return sortMs;
+}
+
+//HDR AND BLOOM
+//The scene target is RGBA16F. After the transparent pass, a bright pass
+//writes what is above the threshold into the first level of a pyramid
+//of half-size targets, a dual filter downsamples it level by level and
+//upsamples it back up, adding every level onto the next larger one. The
+//tonemap pass adds the bloom to the scene and writes sRGB to the window.
+//Only fragment shaders and bilinear taps, so it runs on llvmpipe too.
+const int MAX_BLOOM_LEVELS = 6;
+
+struct BloomLevel {
+    GLuint fbo;
+    GLuint texture;
+    int width;
+    int height;
+};
+
+BloomLevel bloomLevels[MAX_BLOOM_LEVELS];
+int bloomLevelCount = 0;
+int bloomWidth = 0, bloomHeight = 0;
+
+//Quality setting: pyramid depth, 0 disables the bloom. Fewer levels are
+//cheaper but give a smaller glow.
+int bloomQuality = 5;
+float bloomThreshold = 1.0f;
+float bloomStrength = 0.6f;
+float exposure = 1.0f;
+float sunIntensity = 4.0f;
+
+void resizeBloom(int width, int height)
+{
+    if (bloomWidth == width && bloomHeight == height)
+        return;
+    for (int i = 0; i < bloomLevelCount; i++) {
+        glDeleteFramebuffers(1, &bloomLevels[i].fbo);
+        glDeleteTextures(1, &bloomLevels[i].texture);
+    }
+    bloomWidth = width;
+    bloomHeight = height;
+    bloomLevelCount = 0;
+    for (int i = 0; i < MAX_BLOOM_LEVELS; i++) {
+        BloomLevel &level = bloomLevels[i];
+        level.width = std::max(1, width >> (i + 1));
+        level.height = std::max(1, height >> (i + 1));
+        level.texture = createTargetTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT, level.width, level.height);
+        glGenFramebuffers(1, &level.fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, level.fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, level.texture, 0);
+        checkFramebuffer("Bloom");
+        bloomLevelCount++;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+//GPU timing of the frame stages with GL_TIME_ELAPSED queries. The results
+//are read one frame late (two query sets) so that reading never stalls.
+enum GPUStage { STAGE_SCENE, STAGE_TRANSPARENT, STAGE_BRIGHT, STAGE_DOWNSAMPLE, STAGE_UPSAMPLE,
+                STAGE_TONEMAP, NUM_STAGES };
+const char *stageNames[NUM_STAGES] = { "gpu scene ms", "gpu transparent ms", "gpu bright pass ms",
+                                       "gpu downsample ms", "gpu upsample ms", "gpu tonemap ms" };
+
+struct GPUTimer {
+    GLuint queries[2][NUM_STAGES];
+    bool issued[2][NUM_STAGES];
+    int frame;
+    double frameMs;  //Sum of the stages of the last resolved frame.
+};
+
+GPUTimer gpuTimer;
+
+void initGPUTimer(void)
+{
+    glGenQueries(2 * NUM_STAGES, &gpuTimer.queries[0][0]);
+    memset(gpuTimer.issued, 0, sizeof(gpuTimer.issued));
+    gpuTimer.frame = 0;
+    gpuTimer.frameMs = 0.0;
+}
+
+void beginStage(GPUStage stage)
+{
+    glBeginQuery(GL_TIME_ELAPSED, gpuTimer.queries[gpuTimer.frame & 1][stage]);
+}
+
+void endStage(GPUStage stage)
+{
+    glEndQuery(GL_TIME_ELAPSED);
+    gpuTimer.issued[gpuTimer.frame & 1][stage] = true;
+}
+
+//Publishes last frame's results to the profiler and flips the sets.
+void resolveGPUTimer(void)
+{
+    gpuTimer.frame++;
+    int set = gpuTimer.frame & 1;
+    double total = 0.0;
+    for (int stage = 0; stage < NUM_STAGES; stage++) {
+        if (!gpuTimer.issued[set][stage])
+            continue;
+        GLuint available = 0;
+        glGetQueryObjectuiv(gpuTimer.queries[set][stage], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(gpuTimer.queries[set][stage], GL_QUERY_RESULT, &ns);
+            profiler.set(stageNames[stage], ns / 1.0e6);
+            total += ns / 1.0e6;
+        }
+        gpuTimer.issued[set][stage] = false;
+    }
+    gpuTimer.frameMs = total;
+}
+
+void bindPostTexture(int unit, GLuint texture)
+{
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+//Runs the bloom pyramid on the scene target, then tonemaps the result
+//into the bound draw framebuffer (viewport x, y, width, height).
+void postProcess(const RenderTarget &scene, int x, int y, int width, int height)
+{
+    glDisable(GL_DEPTH_TEST);
+    glDepthMask(GL_FALSE);
+    int levels = std::min(bloomQuality, MAX_BLOOM_LEVELS);
+    GLint output;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &output);
+
+    if (levels > 0) {
+        resizeBloom(scene.width, scene.height);
+
+        beginStage(STAGE_BRIGHT);
+        glBindFramebuffer(GL_FRAMEBUFFER, bloomLevels[0].fbo);
+        glViewport(0, 0, bloomLevels[0].width, bloomLevels[0].height);
+        globals.brightProgram->enable();
+        bindPostTexture(0, scene.color);
+        globals.brightProgram->setUniform1i("u_scene", 0);
+        globals.brightProgram->setUniform1f("u_threshold", bloomThreshold);
+        globals.brightProgram->setUniform1f("u_knee", bloomThreshold * 0.5f);
+        drawFullscreenTriangle();
+        globals.brightProgram->disable();
+        endStage(STAGE_BRIGHT);
+
+        beginStage(STAGE_DOWNSAMPLE);
+        globals.bloomDownProgram->enable();
+        globals.bloomDownProgram->setUniform1i("u_source", 0);
+        for (int i = 1; i < levels; i++) {
+            glBindFramebuffer(GL_FRAMEBUFFER, bloomLevels[i].fbo);
+            glViewport(0, 0, bloomLevels[i].width, bloomLevels[i].height);
+            bindPostTexture(0, bloomLevels[i - 1].texture);
+            globals.bloomDownProgram->setUniform2f("u_halfPixel", 0.5f / bloomLevels[i - 1].width,
+                                                  0.5f / bloomLevels[i - 1].height);
+            drawFullscreenTriangle();
+        }
+        globals.bloomDownProgram->disable();
+        endStage(STAGE_DOWNSAMPLE);
+
+        beginStage(STAGE_UPSAMPLE);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        globals.bloomUpProgram->enable();
+        globals.bloomUpProgram->setUniform1i("u_source", 0);
+        for (int i = levels - 1; i > 0; i--) {
+            glBindFramebuffer(GL_FRAMEBUFFER, bloomLevels[i - 1].fbo);
+            glViewport(0, 0, bloomLevels[i - 1].width, bloomLevels[i - 1].height);
+            bindPostTexture(0, bloomLevels[i].texture);
+            globals.bloomUpProgram->setUniform2f("u_halfPixel", 0.5f / bloomLevels[i].width,
+                                                0.5f / bloomLevels[i].height);
+            drawFullscreenTriangle();
+        }
+        globals.bloomUpProgram->disable();
+        glDisable(GL_BLEND);
+        endStage(STAGE_UPSAMPLE);
+    }
+
+    beginStage(STAGE_TONEMAP);
+    glBindFramebuffer(GL_FRAMEBUFFER, output);
+    glViewport(x, y, width, height);
+    globals.tonemapProgram->enable();
+    bindPostTexture(0, scene.color);
+    bindPostTexture(1, levels > 0 ? bloomLevels[0].texture : 0);
+    globals.tonemapProgram->setUniform1i("u_scene", 0);
+    globals.tonemapProgram->setUniform1i("u_bloom", 1);
+    globals.tonemapProgram->setUniform1f("u_bloomStrength", levels > 0 ? bloomStrength : 0.0f);
+    globals.tonemapProgram->setUniform1f("u_exposure", exposure);
+    globals.tonemapProgram->setUniform1f("u_srgb", gammaCorrection ? 1.0f : 0.0f);
+    drawFullscreenTriangle();
+    globals.tonemapProgram->disable();
+    bindPostTexture(1, 0);
+    glActiveTexture(GL_TEXTURE0);
+    endStage(STAGE_TONEMAP);
+
+    glDepthMask(GL_TRUE);
+    glEnable(GL_DEPTH_TEST);
+}
+
+//ORBITS AND TRAILS
+//The orbit ellipses are computed once from the orbital elements in world
+//space. Every view moves them to render space in double precision and
+//updates a VBO allocated once with them, drawn with one glMultiDrawArrays
+//call.
+const int ORBIT_SEGMENTS = 128;
+
+std::vector<glm::dvec3> orbitVertices;
+GLuint orbitVBO = 0;
+bool showOrbits = true;
+bool showTrails = true;
+
+void createOrbits(void)
+{
+	orbitVertices.clear();
+	for (int i = 1; i < NUM_BODIES; i++)
+		for (int s = 0; s < ORBIT_SEGMENTS; s++)
+			orbitVertices.push_back(orbitPosition(bodies[i], 360.0 * s / ORBIT_SEGMENTS));
+	if (orbitVBO == 0)
+		glGenBuffers(1, &orbitVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, orbitVBO);
+	glBufferData(GL_ARRAY_BUFFER, orbitVertices.size() * sizeof(glm::vec3), NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void drawOrbits(void)
+{
+	FrameArena::Scope scope(frameArena);
+	glm::vec3 *vertices = frameArena.allocate<glm::vec3>(orbitVertices.size());
+	for (size_t i = 0; i < orbitVertices.size(); i++)
+		vertices[i] = toRender(orbitVertices[i]);
+	static GLint first[NUM_BODIES - 1];
+	static GLsizei count[NUM_BODIES - 1];
+	for (int i = 0; i < NUM_BODIES - 1; i++)
+	{
+		first[i] = i * ORBIT_SEGMENTS;
+		count[i] = ORBIT_SEGMENTS;
+	}
+	glColor3f(0.25f, 0.25f, 0.35f);
+	glBindBuffer(GL_ARRAY_BUFFER, orbitVBO);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, orbitVertices.size() * sizeof(glm::vec3), vertices);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, (const GLvoid *)0);
+	glMultiDrawArrays(GL_LINE_LOOP, first, count, NUM_BODIES - 1);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glColor3f(1.0f, 1.0f, 1.0f);
+}
+
+//Motion trails of the last length positions of up to capacity objects.
+//The positions live in a GPU ring buffer that is allocated once: slot s
+//holds one position per trail, so each step uploads a single contiguous
+//block of numTrails positions with glBufferSubData. A static element
+//buffer connects slot s to slot s + 1 for every trail; the segment from
+//the newest slot back to the oldest one is skipped when drawing, and the
+//whole set is drawn as one GL_LINES batch.
+//Each slot stores its positions relative to its own origin in double
+//precision, the camera when the slot was written, so the positions near
+//the camera are precise. When drawing, the offsets from the slot origins
+//to the render origin are computed in double and passed to the shader.
+const int MAX_TRAIL_LENGTH = 64;           //Size of u_slotOffset in trail.vert.
+
+struct TrailBuffer {
+	int capacity;
+	int length;
+	int numTrails;     //Trails in use, <= capacity.
+	int head;          //Newest slot.
+	long lastStep;
+	GLuint vbo;
+	GLuint ibo;
+	std::vector<unsigned> generation;  //Of the object of each trail at the last push.
+	std::vector<glm::dvec3> origin;    //Of the positions of each slot.
+};
+
+TrailBuffer trails;
+
+void createTrails(TrailBuffer *trail, int capacity, int length)
+{
+	length = std::min(length, MAX_TRAIL_LENGTH);
+	trail->capacity = capacity;
+	trail->length = length;
+	trail->numTrails = 0;
+	trail->head = 0;
+	trail->lastStep = -1;
+	trail->generation.assign(capacity, 0);
+	trail->origin.assign(length, glm::dvec3(0.0));
+
+	glGenBuffers(1, &trail->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, trail->vbo);
+	glBufferData(GL_ARRAY_BUFFER, (size_t)capacity * length * sizeof(glm::vec3), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//The element buffer is laid out by segment, so the segments starting
+	//at slot s are the contiguous range [s * 2 * capacity, (s + 1) * 2 * capacity).
+	std::vector<GLuint> indices((size_t)capacity * length * 2);
+	size_t k = 0;
+	for (int s = 0; s < length; s++)
+		for (int t = 0; t < capacity; t++)
+		{
+			indices[k++] = s * capacity + t;
+			indices[k++] = ((s + 1) % length) * capacity + t;
+		}
+	glGenBuffers(1, &trail->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trail->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+//Appends one position per trail, relative to origin. When the number of
+//trails changes, the whole ring is reset to the current positions. A
+//trail whose generation changed (the object was respawned or the time
+//was seeked) is filled with its new position, so that no segment spans
+//the jump. generations may be NULL if objects never jump.
+void pushTrails(TrailBuffer *trail, const glm::vec3 *positions, const glm::dvec3 &origin,
+                const unsigned *generations, int count)
+{
+	count = std::min(count, trail->capacity);
+	glBindBuffer(GL_ARRAY_BUFFER, trail->vbo);
+	if (count != trail->numTrails)
+	{
+		trail->numTrails = count;
+		for (int s = 0; s < trail->length; s++)
+		{
+			trail->origin[s] = origin;
+			glBufferSubData(GL_ARRAY_BUFFER, (size_t)s * trail->capacity * sizeof(glm::vec3),
+			                count * sizeof(glm::vec3), positions);
+		}
+		if (generations)
+			std::copy(generations, generations + count, trail->generation.begin());
+	}
+	else
+	{
+		trail->head = (trail->head + 1) % trail->length;
+		trail->origin[trail->head] = origin;
+		glBufferSubData(GL_ARRAY_BUFFER, (size_t)trail->head * trail->capacity * sizeof(glm::vec3),
+		                count * sizeof(glm::vec3), positions);
+		for (int t = 0; generations && t < count; t++)
+		{
+			if (generations[t] == trail->generation[t])
+				continue;
+			trail->generation[t] = generations[t];
+			for (int s = 0; s < trail->length; s++)
+			{
+				glm::vec3 position(glm::dvec3(positions[t]) + (origin - trail->origin[s]));
+				glBufferSubData(GL_ARRAY_BUFFER, ((size_t)s * trail->capacity + t) * sizeof(glm::vec3),
+				                sizeof(glm::vec3), &position);
+			}
+		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void drawMars(void)
+void drawTrails(const TrailBuffer &trail, cgtk::GLSLProgram &program)
 {
-	mars_x = 11.0f * cos(marsOrbitAroundSun * 0.30f / 180.0 * PI);
-	mars_y = 11.0f * sin(marsOrbitAroundSun * 0.30f / 180.0 * PI);
+	if (trail.numTrails == 0)
+		return;
+
+	//One index range per slot, covering the trails in use, except for
+	//the slot of the newest position whose segments would wrap around to
+	//the oldest one.
+	FrameArena::Scope scope(frameArena);
+	GLsizei *counts = frameArena.allocate<GLsizei>(trail.length);
+	const GLvoid **offsets = frameArena.allocate<const GLvoid *>(trail.length);
+	GLsizei ranges = 0;
+	size_t segment = 2 * (size_t)trail.capacity;
+	for (int s = 0; s < trail.length; s++)
+	{
+		if (s == trail.head)
+			continue;
+		counts[ranges] = 2 * trail.numTrails;
+		offsets[ranges] = (const GLvoid *)(s * segment * sizeof(GLuint));
+		ranges++;
+	}
 
-	if(marsOrbitAroundSun == 0)
-		marsOriginX = mars_x;
-	if(mars_x >= marsOriginX)
-		marsOrbitAroundSun = 0.0f;
+	static UniformLocation slotOffsetLocation;
+	glm::vec3 *slotOffsets = frameArena.allocate<glm::vec3>(trail.length);
+	for (int s = 0; s < trail.length; s++)
+		slotOffsets[s] = toRender(trail.origin[s]);
+
+	glDepthMask(GL_FALSE);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	program.enable();
+	glUniform3fv(uniformLocation(&slotOffsetLocation, "u_slotOffset"), trail.length, &slotOffsets[0][0]);
+	program.setUniform1i("u_numTrails", trail.capacity);
+	program.setUniform1i("u_length", trail.length);
+	program.setUniform1i("u_head", trail.head);
+	program.setUniform3f("u_color", 0.3f, 0.5f, 0.8f);
+	glBindBuffer(GL_ARRAY_BUFFER, trail.vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trail.ibo);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, (const GLvoid *)0);
+	glMultiDrawElements(GL_LINES, counts, GL_UNSIGNED_INT, offsets, ranges);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	program.disable();
+	glDisable(GL_BLEND);
+	glDepthMask(GL_TRUE);
+}
+
+//Draw each one of the astronomical objects.
+void drawBody(const DrawItem &item)
+{
 	glActiveTexture(GL_TEXTURE0);
     glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[4]);
+    glBindTexture (GL_TEXTURE_2D, textures[item.texture]);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glPushMatrix();
-	glTranslatef(mars_x, 0, mars_y);
+	glm::vec3 position = toRender(item.position);
+	glTranslatef(position.x, position.y, position.z);
 	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(90,1.0f,0.0f,0.0f);
-    glRotatef(marsRotation,0.0f,0.0f,1.0f);
+	glRotatef(item.tilt,1.0f,0.0f,0.0f);
+    glRotatef(item.rotation,0.0f,0.0f,1.0f);
 	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 0.27, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
+	gluSphere(sun, item.radius, quality().sphereSlices, quality().sphereSlices); //Parameters -> (qobj, radius, slices, stacks)
 	glPopMatrix();
     glDisable(GL_TEXTURE_2D);
 }
 
-void drawJupiter(void)
+void drawMilkyWay(void) //Draw the skysphere of the Milky Way. 
 {
-	jupiter_x = 15.0f * cos(jupiterOrbitAroundSun * 0.30f / 180.0 * PI);
-	jupiter_y = 15.0f * sin(jupiterOrbitAroundSun * 0.30f / 180.0 * PI);
-
-	if(jupiterOrbitAroundSun == 0)
-		jupiterOriginX = jupiter_x;
-	if(jupiter_x >= jupiterOriginX)
-		jupiterOrbitAroundSun = 0.0f;
 	glActiveTexture(GL_TEXTURE0);
     glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[5]);
+    glBindTexture (GL_TEXTURE_2D, textures[9]);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glPushMatrix();
-	glTranslatef(jupiter_x, 0, jupiter_y);
+	glTranslatef(0, 0, 0);
 	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(90,1.0f,0.0f,0.0f);
-    glRotatef(jupiterRotation,0.0f,0.0f,1.0f);
+	glRotatef(0.0f,1.0f,0.0f,0.0f);
 	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 0.7, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
+	gluSphere(sun, 40, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
 	glPopMatrix();
     glDisable(GL_TEXTURE_2D);
 }
 
-void drawSaturn(void)
+//End of drawing of astronomical objects.
+
+//SCENARIO FILES
+//Catalogs of minor planets and stars are converted once from their text
+//formats into a compact binary scenario file, which is then mapped into
+//memory and used in place: the arrays of the file are the SoA arrays of
+//the catalog, with no parsing or copying at startup. All arrays are
+//little-endian float32 and start on a 64-byte boundary.
+enum ScenarioArray {
+	MINOR_SEMI_MAJOR_AXIS,  //AU
+	MINOR_ECCENTRICITY,
+	MINOR_INCLINATION,      //Degrees, to the ecliptic.
+	MINOR_NODE,             //Longitude of the ascending node, degrees.
+	MINOR_PERIAPSIS,        //Argument of the periapsis, degrees.
+	MINOR_MEAN_ANOMALY,     //Degrees, at the epoch of the catalog.
+	MINOR_MEAN_MOTION,      //Degrees per day.
+	MINOR_MAGNITUDE,        //Absolute magnitude H.
+	STAR_X, STAR_Y, STAR_Z, //Unit direction in scene axes.
+	STAR_MAGNITUDE,         //Apparent visual magnitude.
+	STAR_COLOR_INDEX,       //B-V.
+	NUM_SCENARIO_ARRAYS
+};
+
+const char SCENARIO_MAGIC[8] = { 'S', 'O', 'L', 'S', 'C', 'E', 'N', '\0' };
+const uint32_t SCENARIO_VERSION = 1;
+const uint32_t SCENARIO_BYTE_ORDER = 0x01020304;
+const uint64_t SCENARIO_ALIGNMENT = 64;
+
+struct ScenarioHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t minorCount;
+	uint64_t starCount;
+	uint64_t offset[NUM_SCENARIO_ARRAYS];  //Byte offsets from the start of the file.
+};
+
+struct MinorBodies {
+	size_t count;
+	const float *semiMajorAxis, *eccentricity, *inclination, *node, *periapsis, *meanAnomaly,
+	            *meanMotion, *magnitude;
+};
+
+struct StarCatalog {
+	size_t count;
+	const float *x, *y, *z, *magnitude, *colorIndex;
+};
+
+struct Scenario {
+	Scenario() : data(NULL), size(0) { memset(&minor, 0, sizeof(minor)); memset(&stars, 0, sizeof(stars)); }
+	const char *data;  //The mapped file.
+	size_t size;
+	MinorBodies minor;
+	StarCatalog stars;
+};
+
+Scenario scenario;
+
+//Semi-major axes of the planets in AU. The scene compresses the orbits,
+//so catalog distances are mapped piecewise linearly between these and
+//the orbit radii of the planets.
+const float ORBIT_AU[NUM_BODIES] = { 0.0f, 0.387f, 0.723f, 1.0f, 1.524f, 5.203f, 9.537f, 19.19f, 30.07f };
+const float EARTH_MEAN_MOTION = 0.9856076686f; //Degrees per day.
+
+size_t scenarioArrayCount(const ScenarioHeader &header, int array)
+{
+	return array < STAR_X ? header.minorCount : header.starCount;
+}
+
+//Maps a scenario file and points the catalogs into it. The mapping stays
+//for the lifetime of the program; its pages are clean and backed by the
+//file, so the kernel can drop them under memory pressure.
+bool loadScenario(const std::string &filename, Scenario *result)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Error: Could not open scenario " << filename << "." << std::endl;
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ScenarioHeader)) {
+		std::cerr << "Error: " << filename << " is not a scenario file." << std::endl;
+		close(fd);
+		return false;
+	}
+	size_t size = info.st_size;
+	void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		std::cerr << "Error: Could not map scenario " << filename << "." << std::endl;
+		return false;
+	}
+
+	const ScenarioHeader &header = *(const ScenarioHeader *)data;
+	bool valid = memcmp(header.magic, SCENARIO_MAGIC, sizeof(SCENARIO_MAGIC)) == 0 &&
+	             header.version == SCENARIO_VERSION && header.byteOrder == SCENARIO_BYTE_ORDER &&
+	             header.minorCount <= size / sizeof(float) && header.starCount <= size / sizeof(float);
+	for (int i = 0; valid && i < NUM_SCENARIO_ARRAYS; i++)
+		valid = header.offset[i] % SCENARIO_ALIGNMENT == 0 && header.offset[i] <= size &&
+		        scenarioArrayCount(header, i) <= (size - header.offset[i]) / sizeof(float);
+	if (!valid) {
+		std::cerr << "Error: " << filename << " is not a valid scenario file (version " << SCENARIO_VERSION
+		          << ")." << std::endl;
+		munmap(data, size);
+		return false;
+	}
+
+	const char *base = (const char *)data;
+	const float *array[NUM_SCENARIO_ARRAYS];
+	for (int i = 0; i < NUM_SCENARIO_ARRAYS; i++)
+		array[i] = (const float *)(base + header.offset[i]);
+	result->data = base;
+	result->size = size;
+	MinorBodies &minor = result->minor;
+	minor.count = header.minorCount;
+	minor.semiMajorAxis = array[MINOR_SEMI_MAJOR_AXIS];
+	minor.eccentricity = array[MINOR_ECCENTRICITY];
+	minor.inclination = array[MINOR_INCLINATION];
+	minor.node = array[MINOR_NODE];
+	minor.periapsis = array[MINOR_PERIAPSIS];
+	minor.meanAnomaly = array[MINOR_MEAN_ANOMALY];
+	minor.meanMotion = array[MINOR_MEAN_MOTION];
+	minor.magnitude = array[MINOR_MAGNITUDE];
+	StarCatalog &stars = result->stars;
+	stars.count = header.starCount;
+	stars.x = array[STAR_X];
+	stars.y = array[STAR_Y];
+	stars.z = array[STAR_Z];
+	stars.magnitude = array[STAR_MAGNITUDE];
+	stars.colorIndex = array[STAR_COLOR_INDEX];
+	return true;
+}
+
+//Parses a field of a fixed-width line (1-based, inclusive columns as in
+//the MPC documentation). Returns false if the field is blank.
+bool parseColumns(const char *line, int first, int last, float *value)
+{
+	char field[32];
+	int length = last - first + 1;
+	memcpy(field, line + first - 1, length);
+	field[length] = '\0';
+	char *end;
+	*value = strtof(field, &end);
+	return end != field;
+}
+
+//Reads orbital elements in the MPCORB.DAT format of the Minor Planet
+//Center. Header lines and bodies on open orbits are skipped.
+bool readMinorPlanets(const std::string &filename, std::vector<float> *arrays)
+{
+	FILE *file = fopen(filename.c_str(), "r");
+	if (file == NULL) {
+		std::cerr << "Error: Could not open " << filename << "." << std::endl;
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	size_t expected = ftell(file) / 104 + 1; //Lines are at least 104 characters long.
+	fseek(file, 0, SEEK_SET);
+	for (int i = MINOR_SEMI_MAJOR_AXIS; i <= MINOR_MAGNITUDE; i++)
+		arrays[i].reserve(expected);
+
+	char line[512];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strlen(line) < 104)
+			continue;
+		float h, m, peri, node, incl, e, n, a;
+		if (!parseColumns(line, 27, 35, &m) || !parseColumns(line, 38, 46, &peri) ||
+		    !parseColumns(line, 49, 57, &node) || !parseColumns(line, 60, 68, &incl) ||
+		    !parseColumns(line, 71, 79, &e) || !parseColumns(line, 81, 91, &n) ||
+		    !parseColumns(line, 93, 103, &a) || !(e >= 0.0f && e < 1.0f) || !(a > 0.0f))
+			continue;
+		if (!parseColumns(line, 9, 13, &h))
+			h = 20.0f; //Not known for some bodies; typical of a small asteroid.
+		arrays[MINOR_SEMI_MAJOR_AXIS].push_back(a);
+		arrays[MINOR_ECCENTRICITY].push_back(e);
+		arrays[MINOR_INCLINATION].push_back(incl);
+		arrays[MINOR_NODE].push_back(node);
+		arrays[MINOR_PERIAPSIS].push_back(peri);
+		arrays[MINOR_MEAN_ANOMALY].push_back(m);
+		arrays[MINOR_MEAN_MOTION].push_back(n);
+		arrays[MINOR_MAGNITUDE].push_back(h);
+	}
+	fclose(file);
+	return true;
+}
+
+//Reads a star catalog in CSV with a header line, as the HYG database:
+//the columns ra (hours), dec (degrees), mag and ci are used, the others
+//ignored. The directions are turned from equatorial into ecliptic
+//coordinates, so the sky lines up with the orbital plane.
+bool readStars(const std::string &filename, std::vector<float> *arrays)
+{
+	std::ifstream file(filename.c_str());
+	std::string line;
+	if (!file.good() || !std::getline(file, line)) {
+		std::cerr << "Error: Could not open " << filename << "." << std::endl;
+		return false;
+	}
+	int column[4] = { -1, -1, -1, -1 };
+	const char *names[4] = { "ra", "dec", "mag", "ci" };
+	std::istringstream header(line);
+	std::string name;
+	for (int i = 0; std::getline(header, name, ','); i++) {
+		name.erase(std::remove(name.begin(), name.end(), '"'), name.end());
+		name.erase(std::remove(name.begin(), name.end(), '\r'), name.end());
+		for (int j = 0; j < 4; j++)
+			if (name == names[j])
+				column[j] = i;
+	}
+	if (column[0] < 0 || column[1] < 0 || column[2] < 0) {
+		std::cerr << "Error: " << filename << " needs the columns ra, dec and mag." << std::endl;
+		return false;
+	}
+
+	const double obliquity = 23.4393 / 180.0 * PI;
+	std::vector<std::string> fields;
+	while (std::getline(file, line)) {
+		fields.clear();
+		std::istringstream stream(line);
+		std::string field;
+		while (std::getline(stream, field, ','))
+			fields.push_back(field);
+		if ((int)fields.size() <= std::max(column[0], std::max(column[1], column[2])))
+			continue;
+		double ra = atof(fields[column[0]].c_str()) * 15.0 / 180.0 * PI;
+		double dec = atof(fields[column[1]].c_str()) / 180.0 * PI;
+		float mag = atof(fields[column[2]].c_str());
+		if (mag < -5.0f)
+			continue; //The Sun.
+		float ci = 0.65f; //Sun-like where the color is not known.
+		if (column[3] >= 0 && column[3] < (int)fields.size() && !fields[column[3]].empty())
+			ci = atof(fields[column[3]].c_str());
+		double x = cos(dec) * cos(ra), y = cos(dec) * sin(ra), z = sin(dec);
+		double eclipticY = y * cos(obliquity) + z * sin(obliquity);
+		double eclipticZ = -y * sin(obliquity) + z * cos(obliquity);
+		//The orbital plane of the scene is x-z.
+		arrays[STAR_X].push_back(x);
+		arrays[STAR_Y].push_back(eclipticZ);
+		arrays[STAR_Z].push_back(eclipticY);
+		arrays[STAR_MAGNITUDE].push_back(mag);
+		arrays[STAR_COLOR_INDEX].push_back(ci);
+	}
+	return true;
+}
+
+bool writeScenario(const std::string &filename, const std::vector<float> *arrays)
+{
+	ScenarioHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENARIO_MAGIC, sizeof(SCENARIO_MAGIC));
+	header.version = SCENARIO_VERSION;
+	header.byteOrder = SCENARIO_BYTE_ORDER;
+	header.minorCount = arrays[MINOR_SEMI_MAJOR_AXIS].size();
+	header.starCount = arrays[STAR_X].size();
+	uint64_t offset = sizeof(header);
+	for (int i = 0; i < NUM_SCENARIO_ARRAYS; i++) {
+		offset = (offset + SCENARIO_ALIGNMENT - 1) / SCENARIO_ALIGNMENT * SCENARIO_ALIGNMENT;
+		header.offset[i] = offset;
+		offset += scenarioArrayCount(header, i) * sizeof(float);
+	}
+
+	std::ofstream file(filename.c_str(), std::ios::binary);
+	file.write((const char *)&header, sizeof(header));
+	uint64_t position = sizeof(header);
+	static const char padding[SCENARIO_ALIGNMENT] = { 0 };
+	for (int i = 0; i < NUM_SCENARIO_ARRAYS; i++) {
+		file.write(padding, header.offset[i] - position);
+		file.write((const char *)arrays[i].data(), arrays[i].size() * sizeof(float));
+		position = header.offset[i] + arrays[i].size() * sizeof(float);
+	}
+	if (!file.good()) {
+		std::cerr << "Error: Could not write " << filename << "." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+//Sorts the stars from the brightest to the faintest, so that drawing a
+//prefix of the catalog drops the faint stars first.
+void sortStars(std::vector<float> *arrays)
+{
+	const std::vector<float> &magnitude = arrays[STAR_MAGNITUDE];
+	std::vector<int> order(magnitude.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return magnitude[a] < magnitude[b]; });
+	std::vector<float> sorted(order.size());
+	for (int array = STAR_X; array <= STAR_COLOR_INDEX; array++) {
+		for (size_t i = 0; i < order.size(); i++)
+			sorted[i] = arrays[array][order[i]];
+		arrays[array].swap(sorted);
+	}
+}
+
+//Converts the given text catalogs (either may be empty) into a scenario
+//file.
+bool convertScenario(const std::string &minorPlanets, const std::string &stars, const std::string &output)
+{
+	std::vector<float> arrays[NUM_SCENARIO_ARRAYS];
+	if (!minorPlanets.empty() && !readMinorPlanets(minorPlanets, arrays))
+		return false;
+	if (!stars.empty() && !readStars(stars, arrays))
+		return false;
+	sortStars(arrays);
+	std::cout << "Scenario " << output << ": " << arrays[MINOR_SEMI_MAJOR_AXIS].size() << " minor planets, "
+	          << arrays[STAR_X].size() << " stars." << std::endl;
+	return writeScenario(output, arrays);
+}
+
+//A range of scenario arrays uploaded as one vertex buffer, with one float
+//attribute per array.
+struct ScenarioBuffer {
+	GLuint vbo;
+	size_t count;
+	int first, last;                          //Arrays in the buffer.
+	GLintptr offset[NUM_SCENARIO_ARRAYS];     //Of each array in the buffer.
+};
+
+//Uploads the arrays first to last, which are consecutive in the file,
+//straight from the mapping.
+void createScenarioBuffer(const Scenario &scene, int first, int last, ScenarioBuffer *buffer)
+{
+	buffer->vbo = 0;
+	buffer->count = 0;
+	buffer->first = first;
+	buffer->last = last;
+	//Without a scenario file the buffer stays empty, and the sky falls
+	//back to the sphere.
+	if (scene.data == NULL)
+		return;
+	const ScenarioHeader &header = *(const ScenarioHeader *)scene.data;
+	buffer->count = scenarioArrayCount(header, first);
+	if (buffer->count == 0)
+		return;
+	GLintptr start = header.offset[first];
+	GLsizeiptr size = header.offset[last] + buffer->count * sizeof(float) - start;
+	for (int i = first; i <= last; i++)
+		buffer->offset[i] = header.offset[i] - start;
+	madvise((void *)(((uintptr_t)scene.data + start) & ~(uintptr_t)(getpagesize() - 1)),
+	        size + (start & (getpagesize() - 1)), MADV_SEQUENTIAL);
+	glGenBuffers(1, &buffer->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer->vbo);
+	glBufferData(GL_ARRAY_BUFFER, size, scene.data + start, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+//Draws count points with the arrays of the buffer bound to the given
+//attributes (one name per array). The program must be enabled.
+void drawScenarioPoints(cgtk::GLSLProgram &program, const ScenarioBuffer &buffer, const char *const *attributes,
+                        size_t count)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, buffer.vbo);
+	GLint locations[NUM_SCENARIO_ARRAYS];
+	for (int i = buffer.first; i <= buffer.last; i++) {
+		locations[i] = program.getAttribLocation(attributes[i - buffer.first]);
+		if (locations[i] < 0)
+			continue;
+		glEnableVertexAttribArray(locations[i]);
+		glVertexAttribPointer(locations[i], 1, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)buffer.offset[i]);
+	}
+	glEnable(GL_PROGRAM_POINT_SIZE);
+	glDrawArrays(GL_POINTS, 0, std::min(count, buffer.count));
+	glDisable(GL_PROGRAM_POINT_SIZE);
+	for (int i = buffer.first; i <= buffer.last; i++)
+		if (locations[i] >= 0)
+			glDisableVertexAttribArray(locations[i]);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+//The minor planets are drawn as points straight from their elements: the
+//vertex shader solves Kepler's equation for each of them, so the catalog
+//is uploaded once and never touched again.
+ScenarioBuffer minorPlanets;
+bool showMinorPlanets = true;
+
+const char *minorAttributes[] = {
+	"a_semiMajorAxis", "a_eccentricity", "a_inclination", "a_node", "a_periapsis", "a_meanAnomaly",
+	"a_meanMotion", "a_magnitude"
+};
+
+void createMinorPlanets(const Scenario &scene)
+{
+	createScenarioBuffer(scene, MINOR_SEMI_MAJOR_AXIS, MINOR_MAGNITUDE, &minorPlanets);
+}
+
+void drawMinorPlanets(cgtk::GLSLProgram &program, double days)
+{
+	if (minorPlanets.count == 0)
+		return;
+	float knotAU[NUM_BODIES], knotScene[NUM_BODIES];
+	for (int i = 0; i < NUM_BODIES; i++) {
+		knotAU[i] = ORBIT_AU[i];
+		knotScene[i] = bodies[i].orbitRadius;
+	}
+	//The planets are solved in world space; the shader subtracts the render
+	//origin split into a high and a low part, which keeps them as precise
+	//as a double subtraction would near the camera.
+	glm::vec3 originHigh(renderOrigin);
+	glm::vec3 originLow(renderOrigin - glm::dvec3(originHigh));
+	program.enable();
+	program.setUniform1f("u_days", (float)days);
+	program.setUniform3f("u_originHigh", originHigh.x, originHigh.y, originHigh.z);
+	program.setUniform3f("u_originLow", originLow.x, originLow.y, originLow.z);
+	GLint current;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &current);
+	glUniform1fv(glGetUniformLocation(current, "u_knotAU"), NUM_BODIES, knotAU);
+	glUniform1fv(glGetUniformLocation(current, "u_knotScene"), NUM_BODIES, knotScene);
+	drawScenarioPoints(program, minorPlanets, minorAttributes, minorPlanets.count);
+	program.disable();
+}
+
+//Simulated days per step, so that the Earth keeps its pace in the scene.
+double daysPerStep(void)
+{
+	return bodies[EARTH].orbitSpeed * bodies[EARTH].orbitScale / EARTH_MEAN_MOTION;
+}
+
+//STAR FIELD
+//The sky is either the old textured sphere, or the catalog stars as
+//point sprites from one static buffer, optionally over a low-resolution
+//glow of the galactic band. The stars are sorted by magnitude, so the
+//governor can draw only the brightest part of the catalog.
+enum SkyMode { SKY_SPHERE, SKY_STARS, SKY_STARS_AND_BAND, NUM_SKY_MODES };
+
+SkyMode skyMode = SKY_STARS_AND_BAND;
+ScenarioBuffer starField;
+float starLimit = 6.5f;         //Magnitude drawn as one pixel at starBrightness.
+float starBrightness = 0.04f;
+float galacticBandBrightness = 0.5f;
+
+const char *starAttributes[] = { "a_x", "a_y", "a_z", "a_magnitude", "a_colorIndex" };
+
+void createStarField(const Scenario &scene)
+{
+	createScenarioBuffer(scene, STAR_X, STAR_COLOR_INDEX, &starField);
+}
+
+void drawGalacticBand(cgtk::GLSLProgram &program)
+{
+	static UniformLocation inverseViewProjectionLocation;
+	glm::mat4 projection, view;
+	glGetFloatv(GL_PROJECTION_MATRIX, &projection[0][0]);
+	glGetFloatv(GL_MODELVIEW_MATRIX, &view[0][0]);
+	view[3] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	program.enable();
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, galacticBandTexture);
+	program.setUniform1i("u_texture", 0);
+	glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+	glUniformMatrix4fv(uniformLocation(&inverseViewProjectionLocation, "u_inverseViewProjection"), 1, GL_FALSE,
+	                   &inverseViewProjection[0][0]);
+	program.setUniform1f("u_brightness", galacticBandBrightness);
+	drawFullscreenTriangle();
+	glBindTexture(GL_TEXTURE_2D, 0);
+	program.disable();
+}
+
+//Draws count stars, brightest first, blended additively.
+void drawStars(cgtk::GLSLProgram &program, size_t count, float pixelScale)
+{
+	if (starField.count == 0)
+		return;
+	program.enable();
+	program.setUniform1f("u_limit", starLimit);
+	program.setUniform1f("u_brightness", starBrightness);
+	program.setUniform1f("u_pixelScale", pixelScale);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	//The stars are at infinity, on the far plane.
+	glEnable(GL_DEPTH_CLAMP);
+	drawScenarioPoints(program, starField, starAttributes, count);
+	glDisable(GL_DEPTH_CLAMP);
+	glDisable(GL_BLEND);
+	program.disable();
+}
+
+//Draws the sky of the current mode. Falls back to the sphere without a
+//star catalog.
+void drawSky(void)
+{
+	if (skyMode == SKY_SPHERE || starField.count == 0)
+	{
+		drawMilkyWay();
+		return;
+	}
+	glDisable(GL_DEPTH_TEST);
+	if (skyMode == SKY_STARS_AND_BAND)
+		drawGalacticBand(*globals.galacticBandProgram);
+	drawStars(*globals.starProgram, size_t(starField.count * quality().stars), quality().scale);
+	glEnable(GL_DEPTH_TEST);
+}
+
+//SIMULATION
+//Resets a burned out particle to the left edge of the system.
+void respawnParticle(particles &p, unsigned int *seed)
+{
+	p.generation++;
+	p.life=360.0f;					// Give It New Life
+	p.fade= 0.053;              // Random Fade Value
+	p.x = -20.0f;				// Center On X Axis
+	p.y=  rand_r(seed) % 61 - 30;		//Random number between -30 and 30
+	p.z= rand_r(seed) % 11 - 5;	    // Random number between -5 and 5
+}
+
+void updateParticles(int begin, int end)
+{
+	for (int i = begin; i < end; i++)
+	{
+		particles &p = simulation.particle[i];
+		if(!p.active)
+			continue;
+		p.x += 0.006;// Move On The X Axis By X Speed
+		p.xD = p.horizontalMovement;			// Take Pull On X Axis Into Account
+		p.life-=p.fade;
+		if (p.life<0.0f && p.x > 40)					// If Particle Is Burned Out
+		{
+			//Every chunk gets its own seed so that the workers do not
+			//share random state.
+			unsigned int seed = simulation.seed + i * 7919 + simulation.step;
+			respawnParticle(p, &seed);
+		}
+	}
+}
+
+//Advances the simulation by one step and fills the state with the
+//positions and the render list of the new step. Runs on the job system.
+void stepSimulation(FrameState &state)
+{
+	state.simulatedAt = nowMs();
+	simulation.step++;
+	simulation.time += simulation.timeScale;
+
+	//The orbits and spins are closed form in the simulated time. The
+	//orbit angle wraps around after a full revolution, the spin after 360
+	//degrees, which is what the per-frame counters used to do.
+	for (int i = 0; i < NUM_BODIES; i++)
+	{
+		const BodyParams &body = bodies[i];
+		double orbit = fmod(simulation.time * body.orbitSpeed * body.orbitScale, 360.0);
+		state.position[i] = orbitPosition(body, orbit);
+		state.rotation[i] = (float)fmod(simulation.time * body.spinSpeed, 360.0);
+	}
+
+	jobs.parallelFor(MAX_PARTICLES, 256, updateParticles);
+
+	//Build the render list: the bodies first, then the particles.
+	state.drawList.clear();
+	for (int i = 0; i < NUM_BODIES; i++)
+	{
+		DrawItem item;
+		item.texture = bodies[i].texture;
+		item.position = state.position[i];
+		item.tilt = 90.0f;
+		item.rotation = state.rotation[i];
+		item.radius = bodies[i].radius;
+		item.opacity = 1.0f;
+		item.generation = simulation.epoch;
+		state.drawList.push_back(item);
+	}
+
+	//Transparent shells around Earth (clouds) and Venus (atmosphere).
+	state.shellList.clear();
+	DrawItem clouds = state.drawList[EARTH];
+	clouds.texture = 11;
+	clouds.radius *= 1.02f;
+	//The clouds drift slowly relative to the surface. The angle is taken
+	//from the unwrapped time, scaling the wrapped one would jump.
+	clouds.rotation = (float)fmod(simulation.time * bodies[EARTH].spinSpeed * 1.1, 360.0);
+	clouds.opacity = 0.9f;
+	state.shellList.push_back(clouds);
+	DrawItem atmosphere = state.drawList[VENUS];
+	atmosphere.texture = 12;
+	atmosphere.radius *= 1.05f;
+	atmosphere.opacity = 0.6f;
+	state.shellList.push_back(atmosphere);
+
+	state.spriteList.clear();
+	for (int i = 0; i < MAX_PARTICLES; i++)
+	{
+		const particles &p = simulation.particle[i];
+		if(!p.active)
+			continue;
+		DrawItem item;
+		item.texture = 10;
+		item.position = glm::dvec3(p.x, p.z, p.y);
+		item.tilt = 0.0f;
+		item.rotation = 0.0f;
+		item.radius = 0.07f;
+		item.opacity = std::min(1.0f, p.life / 60.0f + 0.2f);
+		item.generation = p.generation;
+		state.spriteList.push_back(item);
+	}
+
+	//Refit (or rebuild) the spatial index of this slot. The slots keep
+	//their own trees, so the render thread can query its frame while the
+	//next one is refitted.
+	double bvhStart = nowMs();
+	state.boundsCenter.clear();
+	state.boundsRadius.clear();
+	for (size_t i = 0; i < state.drawList.size(); i++)
+	{
+		state.boundsCenter.push_back(glm::vec3(state.drawList[i].position));
+		state.boundsRadius.push_back(state.drawList[i].radius);
+	}
+	for (size_t i = 0; i < state.spriteList.size(); i++)
+	{
+		state.boundsCenter.push_back(glm::vec3(state.spriteList[i].position));
+		state.boundsRadius.push_back(state.spriteList[i].radius);
+	}
+	state.bvh.update(&state.boundsCenter[0], &state.boundsRadius[0], (int)state.boundsCenter.size());
+	state.bvhMs = nowMs() - bvhStart;
+
+	state.step = simulation.step;
+	state.time = simulation.time;
+	state.simulateMs = nowMs() - state.simulatedAt;
+}
+
+//Starts the simulation of the next frame on the job system unless the
+//previous one is still running. Never blocks the GLUT thread.
+void kickSimulation(void)
+{
+	if (simulationInFlight.exchange(true))
+		return;
+	jobs.submit([]() {
+		stepSimulation(frameExchange.writeSlot());
+		frameExchange.publish();
+		simulationInFlight = false;
+	}, NULL);
+}
+
+//CAMERA
+//Orbit mode circles the focused body (trackball drag, wheel to zoom),
+//free mode flies around with the keyboard. Focusing a body starts an
+//eased fly-to, after which the camera follows the body in orbit mode.
+//All positions are doubles; the eye becomes the render origin.
+enum CameraMode { CAMERA_ORBIT, CAMERA_FREE };
+
+struct Camera {
+	CameraMode mode;
+	int target;                  //Body followed in orbit mode.
+	glm::dvec3 offset;           //Orbit offset from the target before the trackball rotation.
+	glm::dvec3 eye;
+	glm::dvec3 center;           //Point looked at.
+	double yaw;                  //Free mode orientation, radians.
+	double pitch;
+	double speed;                //Free mode speed per key press.
+	bool flying;
+	double flyStart;
+	double flyDuration;          //Milliseconds.
+	glm::dvec3 flyFromEye;
+	glm::dvec3 flyFromCenter;
+};
+
+Camera camera = { CAMERA_ORBIT, SUN, glm::dvec3(0.0, -20.0, 1.0), glm::dvec3(0.0, -20.0, 1.0),
+                  glm::dvec3(0.0, 0.0, 0.0), 0.0, 0.0, 0.1, false, 0.0, 2000.0,
+                  glm::dvec3(0.0), glm::dvec3(0.0) };
+
+glm::dvec3 cameraForward(void)
+{
+	return glm::dvec3(sin(camera.yaw) * cos(camera.pitch), sin(camera.pitch), -cos(camera.yaw) * cos(camera.pitch));
+}
+
+//Eye position of orbit mode around the current target.
+glm::dvec3 orbitEye(const FrameState &frame)
+{
+	glm::mat3 rotation = glm::mat3(globals.trackball.getRotationMatrix());
+	return frame.position[camera.target] + glm::dvec3(rotation * glm::vec3(camera.offset));
+}
+
+//Starts an eased flight to the given body, ending in orbit mode at a
+//distance of a few radii.
+void focusBody(int body)
+{
+	camera.flyFromEye = camera.eye;
+	camera.flyFromCenter = camera.center;
+	camera.target = body;
+	double distance = (body == SUN ? 20.0 : bodies[body].radius * 6.0);
+	camera.offset = glm::normalize(glm::dvec3(0.0, -1.0, 0.4)) * distance;
+	camera.mode = CAMERA_ORBIT;
+	camera.flying = true;
+	camera.flyStart = animationMs();
+}
+
+//Updates the eye and the look-at point for this frame.
+void updateCamera(const FrameState &frame)
+{
+	glm::dvec3 eye, center;
+	if (camera.mode == CAMERA_ORBIT)
+	{
+		eye = orbitEye(frame);
+		center = frame.position[camera.target];
+	}
+	else
+	{
+		eye = camera.eye;
+		center = camera.eye + cameraForward();
+	}
+
+	if (camera.flying)
+	{
+		//The target keeps moving during the flight, so interpolate
+		//towards its current position every frame. Cubic ease in/out.
+		double t = std::min(1.0, (animationMs() - camera.flyStart) / camera.flyDuration);
+		double s = (t < 0.5 ? 4.0 * t * t * t : 1.0 - pow(-2.0 * t + 2.0, 3.0) / 2.0);
+		eye = camera.flyFromEye + (eye - camera.flyFromEye) * s;
+		center = camera.flyFromCenter + (center - camera.flyFromCenter) * s;
+		camera.flying = (t < 1.0);
+	}
+
+	camera.eye = eye;
+	camera.center = center;
+	renderOrigin = eye;
+}
+
+//Switches between orbit and free mode, keeping the current view.
+void toggleCameraMode(void)
+{
+	camera.flying = false;
+	if (camera.mode == CAMERA_ORBIT)
+	{
+		glm::dvec3 forward = glm::normalize(camera.center - camera.eye);
+		camera.yaw = atan2(forward.x, -forward.z);
+		camera.pitch = asin(glm::clamp(forward.y, -1.0, 1.0));
+		camera.speed = std::max(0.01, glm::length(camera.center - camera.eye) * 0.02);
+		camera.mode = CAMERA_FREE;
+	}
+	else
+	{
+		//Orbit the nearest body from where we are.
+		int nearest = SUN;
+		const FrameState &frame = frameExchange.readSlot();
+		for (int i = 0; i < NUM_BODIES; i++)
+			if (glm::length(frame.position[i] - camera.eye) < glm::length(frame.position[nearest] - camera.eye))
+				nearest = i;
+		focusBody(nearest);
+	}
+}
+
+//VIEWS
+//Several views of the scene can be drawn into the scene target at once:
+//the main view alone, the main view with a top-down orbital map and a
+//close-up of the focused body as insets, or the main view as a side by
+//side stereo pair. The objects are culled once per frame in a single
+//traversal of the BVH against the frustums of all views, which gives
+//each object a mask of the views that see it. The visible bodies are
+//sorted once and every view draws from the same list. The two stereo
+//eyes share one frustum that contains both.
+
+//Reversed-Z needs glClipControl to map depth to [0, 1]; without it the
+//precision gain of the float depth buffer is lost.
+bool reversedZ = false;
+
+//Loads the projection. With reversed-Z the far plane is at infinity and
+//depth 1 is at the near plane, which together with a float depth buffer
+//keeps the precision roughly constant from a few meters to many AU.
+//shift moves the image horizontally, in normalized device coordinates;
+//the stereo eyes use it to converge at the focus distance.
+void applyProjection(double fovy, double aspect, double zNear, double shift)
+{
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glTranslated(shift, 0.0, 0.0);
+	if (reversedZ)
+	{
+		double f = 1.0 / tan(glm::radians(fovy) / 2.0);
+		GLdouble m[16] = { f / aspect, 0.0, 0.0,   0.0,
+		                   0.0,        f,   0.0,   0.0,
+		                   0.0,        0.0, 0.0,  -1.0,
+		                   0.0,        0.0, zNear, 0.0 };
+		glMultMatrixd(m);
+	}
+	else
+		gluPerspective(fovy, aspect, zNear, 1.0e6);
+	glMatrixMode(GL_MODELVIEW);
+}
+
+//Up vector of a view looking along forward: the ecliptic pole, unless
+//the view looks along it.
+glm::dvec3 viewUp(const glm::dvec3 &forward)
+{
+	glm::dvec3 up(0.0, 1.0, 0.0);
+	if (glm::length(glm::cross(glm::normalize(forward), up)) < 1e-3)
+		up = glm::dvec3(0.0, 0.0, 1.0);
+	return up;
+}
+
+//Loads the view matrix. The eye is the render origin, so only the
+//orientation is left in it.
+void applyView(const glm::dvec3 &forward)
+{
+	glLoadIdentity();
+	glm::dvec3 up = viewUp(forward);
+	gluLookAt(0.0, 0.0, 0.0, forward.x, forward.y, forward.z, up.x, up.y, up.z);
+}
+
+void initDepth(void)
+{
+	reversedZ = GLEW_ARB_clip_control;
+	if (reversedZ)
+	{
+		glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
+		glDepthFunc(GL_GREATER);
+		glClearDepth(0.0);
+	}
+}
+
+//Frustum of the current matrices, in render space.
+Frustum currentFrustum(void)
+{
+	GLfloat p[16], mv[16], m[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, p);
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	for (int c = 0; c < 4; c++)
+		for (int r = 0; r < 4; r++)
+		{
+			m[c * 4 + r] = 0.0f;
+			for (int k = 0; k < 4; k++)
+				m[c * 4 + r] += p[k * 4 + r] * mv[c * 4 + k];
+		}
+	Frustum frustum;
+	for (int i = 0; i < 3; i++)
+		for (int s = 0; s < 2; s++)
+		{
+			float *plane = frustum.planes[i * 2 + s];
+			float sign = (s == 0 ? 1.0f : -1.0f);
+			for (int c = 0; c < 4; c++)
+				plane[c] = m[c * 4 + 3] + sign * m[c * 4 + i];
+			float length = sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+			for (int c = 0; c < 4; c++)
+				plane[c] /= length;
+		}
+	return frustum;
+}
+
+
+enum ViewLayout { LAYOUT_SINGLE, LAYOUT_PLANETARIUM, LAYOUT_STEREO, NUM_LAYOUTS };
+enum ViewKind { VIEW_MAIN, VIEW_LEFT_EYE, VIEW_RIGHT_EYE, VIEW_MAP, VIEW_FOCUS };
+
+const char *layoutNames[NUM_LAYOUTS] = { "single", "planetarium", "stereo" };
+const int MAX_VIEWS = 4;
+
+struct View {
+	ViewKind kind;
+	glm::dvec3 eye;
+	glm::dvec3 forward;
+	double fovy;
+	double aspect;
+	double shift;        //Horizontal projection offset, see applyProjection().
+	float rect[4];       //x, y, width, height as fractions of the target.
+	int cullGroup;       //Index of the frustum the view is culled with.
+	bool terrain;        //Draws the terrain chunks selected for the main camera.
+	bool sky;
+};
+
+//The views of one frame and what they see. The arrays are allocated in
+//the frame arena.
+struct ViewSet {
+	ViewSet() : numViews(0), numGroups(0), objectMask(NULL), shellMask(NULL), bodyOrder(NULL), numBodies(0) {}
+	View views[MAX_VIEWS];
+	int numViews;
+	View cullViews[MAX_VIEWS];      //One per cull group, containing the views of the group.
+	Frustum frustums[MAX_VIEWS];    //World space, one per cull group.
+	int numGroups;
+	unsigned char *objectMask;      //Per BVH object: the bodies, then the sprites.
+	unsigned char *shellMask;
+	int *bodyOrder;                 //Visible bodies, front to back from the main camera.
+	int numBodies;
+
+	unsigned char bit(const View &view) const { return (unsigned char)(1 << view.cullGroup); }
+};
+
+ViewLayout viewLayout = LAYOUT_SINGLE;
+float stereoSeparation = 0.03f;     //Eye distance relative to the focus distance.
+ViewSet viewSet;
+
+void setViewRect(View *view, float x, float y, float width, float height)
+{
+	view->rect[0] = x;
+	view->rect[1] = y;
+	view->rect[2] = width;
+	view->rect[3] = height;
+}
+
+View makeView(ViewKind kind, const glm::dvec3 &eye, const glm::dvec3 &forward, double fovy, int cullGroup)
+{
+	View view;
+	view.kind = kind;
+	view.eye = eye;
+	view.forward = forward;
+	view.fovy = fovy;
+	view.aspect = 1.0;
+	view.shift = 0.0;
+	setViewRect(&view, 0.0f, 0.0f, 1.0f, 1.0f);
+	view.cullGroup = cullGroup;
+	view.terrain = (kind == VIEW_MAIN || kind == VIEW_LEFT_EYE || kind == VIEW_RIGHT_EYE);
+	view.sky = (kind != VIEW_MAP);
+	return view;
+}
+
+//Fills in the views of the current layout for a target of the given
+//size, and the view each cull group is culled with.
+void layoutViews(const FrameState &frame, int width, int height, ViewSet *set)
+{
+	glm::dvec3 forward = camera.center - camera.eye;
+	View main = makeView(VIEW_MAIN, camera.eye, forward, 90.0, 0);
+	set->numViews = 0;
+	set->numGroups = 1;
+	if (viewLayout == LAYOUT_STEREO)
+	{
+		//Parallel eyes with off-axis projections that converge at the
+		//focus distance. The cull view is moved back until its frustum,
+		//widened by the eye offset at the focus distance, contains both.
+		double focus = std::max(glm::length(forward), 1e-6);
+		double offset = 0.5 * stereoSeparation * focus;
+		glm::dvec3 right = glm::normalize(glm::cross(forward, viewUp(forward)));
+		for (int eye = 0; eye < 2; eye++)
+		{
+			double side = (eye == 0 ? -1.0 : 1.0);
+			View view = makeView(eye == 0 ? VIEW_LEFT_EYE : VIEW_RIGHT_EYE, camera.eye + right * (side * offset),
+			                     forward, main.fovy, 0);
+			setViewRect(&view, 0.5f * eye, 0.0f, 0.5f, 1.0f);
+			view.aspect = 0.5 * width / height;
+			view.shift = side * offset / (focus * tan(glm::radians(view.fovy) / 2.0) * view.aspect);
+			set->views[set->numViews++] = view;
+		}
+		double halfWidth = focus * tan(glm::radians(main.fovy) / 2.0) * set->views[0].aspect;
+		double back = offset * focus / (halfWidth + offset);
+		main.eye = camera.eye - glm::normalize(forward) * back;
+		main.aspect = set->views[0].aspect * (halfWidth + offset) / halfWidth;
+		set->cullViews[0] = main;
+		return;
+	}
+
+	main.aspect = width / (double)height;
+	set->views[set->numViews++] = main;
+	set->cullViews[0] = main;
+	if (viewLayout != LAYOUT_PLANETARIUM)
+		return;
+
+	//Square insets on the right, the map at the top and the focused body
+	//below it.
+	float side = 0.3f * std::min(width, height), margin = 0.02f * std::min(width, height);
+	float x = (width - side - margin) / width, w = side / width, h = side / height;
+
+	//The map looks down on the orbital plane from high enough to show the
+	//outermost body.
+	double extent = 1.0;
+	for (int i = 0; i < NUM_BODIES; i++)
+		extent = std::max(extent, glm::length(frame.position[i]) + bodies[i].radius);
+	View map = makeView(VIEW_MAP, glm::dvec3(0.0, extent * 1.1, 0.0), glm::dvec3(0.0, -1.0, 0.0), 90.0, 1);
+	setViewRect(&map, x, (height - side - margin) / height, w, h);
+	map.aspect = 1.0;
+
+	//The close-up looks at the day side of the focused body.
+	int target = camera.target;
+	glm::dvec3 toSun = frame.position[SUN] - frame.position[target];
+	glm::dvec3 direction = (target == SUN || glm::length(toSun) < 1e-9 ? glm::dvec3(0.0, 0.3, 1.0) : toSun);
+	double fovy = 30.0;
+	double distance = bodies[target].radius * 1.4 / sin(glm::radians(fovy) / 2.0);
+	View focus = makeView(VIEW_FOCUS, frame.position[target] + glm::normalize(direction) * distance,
+	                      -glm::normalize(direction), fovy, 2);
+	setViewRect(&focus, x, margin / height, w, h);
+	focus.aspect = 1.0;
+
+	set->views[set->numViews++] = map;
+	set->views[set->numViews++] = focus;
+	set->cullViews[set->numGroups++] = map;
+	set->cullViews[set->numGroups++] = focus;
+}
+
+//Sets the render origin, viewport, scissor and matrices of a view into a
+//target of the given size.
+void applyViewport(const View &view, int width, int height)
+{
+	int x = int(view.rect[0] * width + 0.5f), y = int(view.rect[1] * height + 0.5f);
+	int w = std::max(1, int(view.rect[2] * width + 0.5f)), h = std::max(1, int(view.rect[3] * height + 0.5f));
+	glViewport(x, y, w, h);
+	glScissor(x, y, w, h);
+	renderOrigin = view.eye;
+	applyProjection(view.fovy, view.aspect, 0.01, view.shift);
+	applyView(view.forward);
+}
+
+//Lays out the views and culls the frame for all of them. Leaves the
+//matrices of the main cull view loaded.
+void prepareViews(const FrameState &frame, int width, int height, ViewSet *set)
+{
+	double start = nowMs();
+	layoutViews(frame, width, height, set);
+
+	//Render-space frustums, moved to world space.
+	for (int g = 0; g < set->numGroups; g++)
+	{
+		applyViewport(set->cullViews[g], width, height);
+		Frustum frustum = currentFrustum();
+		for (int i = 0; i < 6; i++)
+		{
+			float *plane = frustum.planes[i];
+			plane[3] -= (float)glm::dot(glm::dvec3(plane[0], plane[1], plane[2]), renderOrigin);
+		}
+		set->frustums[g] = frustum;
+	}
+
+	size_t numObjects = frame.boundsCenter.size();
+	set->objectMask = frameArena.allocate<unsigned char>(numObjects);
+	memset(set->objectMask, 0, numObjects);
+	if (numObjects > 0)
+		frame.bvh.queryFrustums(&frame.boundsCenter[0], &frame.boundsRadius[0], set->frustums,
+		                        set->numGroups, set->objectMask);
+
+	set->shellMask = frameArena.allocate<unsigned char>(frame.shellList.size());
+	for (size_t i = 0; i < frame.shellList.size(); i++)
+	{
+		set->shellMask[i] = 0;
+		const DrawItem &shell = frame.shellList[i];
+		for (int g = 0; g < set->numGroups; g++)
+			if (sphereInFrustum(set->frustums[g], glm::vec3(shell.position), shell.radius))
+				set->shellMask[i] |= (unsigned char)(1 << g);
+	}
+
+	//Front to back, so that the depth test rejects the hidden parts of
+	//the farther bodies early.
+	set->bodyOrder = frameArena.allocate<int>(frame.drawList.size());
+	set->numBodies = 0;
+	for (size_t i = 0; i < frame.drawList.size(); i++)
+		if (set->objectMask[i] != 0)
+			set->bodyOrder[set->numBodies++] = (int)i;
+	std::sort(set->bodyOrder, set->bodyOrder + set->numBodies, [&frame](int a, int b) {
+		return glm::length(frame.drawList[a].position - camera.eye) - frame.drawList[a].radius <
+		       glm::length(frame.drawList[b].position - camera.eye) - frame.drawList[b].radius;
+	});
+
+	size_t visible = 0;
+	for (size_t i = 0; i < numObjects; i++)
+		visible += (set->objectMask[i] != 0);
+	profiler.set("views", set->numViews);
+	profiler.set("visible objects", visible);
+	profiler.set("cull ms", nowMs() - start);
+	applyViewport(set->cullViews[0], width, height);
+}
+
+//PICKING
+int hoveredObject = -1;
+glm::ivec2 pressPosition(0, 0);
+
+//Returns the world-space ray through a window pixel, in the topmost
+//view under it. Returns false if there is none yet.
+bool pixelRay(int x, int y, glm::vec3 *origin, glm::vec3 *dir)
+{
+	double u = (x + 0.5) / globals.width, v = 1.0 - (y + 0.5) / globals.height;
+	for (int i = viewSet.numViews - 1; i >= 0; i--)
+	{
+		const View &view = viewSet.views[i];
+		double s = (u - view.rect[0]) / view.rect[2], t = (v - view.rect[1]) / view.rect[3];
+		if (s < 0.0 || s > 1.0 || t < 0.0 || t > 1.0)
+			continue;
+		glm::dvec3 forward = glm::normalize(view.forward);
+		glm::dvec3 right = glm::normalize(glm::cross(forward, viewUp(forward)));
+		glm::dvec3 up = glm::cross(right, forward);
+		double tanHalf = tan(glm::radians(view.fovy) / 2.0);
+		double nx = (2.0 * s - 1.0 - view.shift) * tanHalf * view.aspect;
+		double ny = (2.0 * t - 1.0) * tanHalf;
+		*origin = glm::vec3(view.eye);
+		*dir = glm::vec3(glm::normalize(forward + right * nx + up * ny));
+		return true;
+	}
+	return false;
+}
+
+//Returns the object under the pixel: a body id below NUM_BODIES, a
+//particle above it, or -1.
+int pickObject(const FrameState &frame, int x, int y)
+{
+	if (frame.boundsCenter.empty())
+		return -1;
+	glm::vec3 origin, dir;
+	if (!pixelRay(x, y, &origin, &dir))
+		return -1;
+	double start = nowMs();
+	int object = frame.bvh.raycast(&frame.boundsCenter[0], &frame.boundsRadius[0], origin, dir, NULL);
+	profiler.set("pick us", (nowMs() - start) * 1000.0);
+	return object;
+}
+
+//The name stays valid until the next call.
+const char *objectName(int object)
+{
+	if (object < 0)
+		return "";
+	if (object < NUM_BODIES)
+		return bodies[object].name;
+	static char name[32];
+	sprintf(name, "Particle %d", object - NUM_BODIES);
+	return name;
+}
+
+//PROFILER OVERLAY
+void drawText(int x, int y, const char *text)
+{
+	glWindowPos2i(x, y);
+	for (const char *c = text; *c != '\0'; c++)
+		glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *c);
+}
+
+//Samples the worker utilization once per second.
+void sampleThreadUtilization(void)
+{
+	double now = nowMs();
+	double elapsed = now - profiler.lastSample;
+	if (elapsed < 1000.0)
+		return;
+	profiler.lastBusyMs.resize(jobs.numWorkers(), 0.0);
+	for (int i = 0; i < jobs.numWorkers(); i++)
+	{
+		double busy = jobs.busyMs(i);
+		char name[32];
+		sprintf(name, "worker %d %%", i);
+		profiler.set(name, 100.0 * (busy - profiler.lastBusyMs[i]) / elapsed);
+		profiler.lastBusyMs[i] = busy;
+	}
+	profiler.lastSample = now;
+}
+
+void drawProfiler(void)
+{
+	if (!profiler.visible)
+		return;
+	glColor3f(1.0f, 1.0f, 0.0f);
+	int y = globals.height - 16;
+	for (size_t i = 0; i < profiler.values.size(); i++)
+	{
+		char line[128];
+		snprintf(line, sizeof(line), "%-24s %8.2f", profiler.values[i].name, profiler.values[i].value);
+		drawText(8, y, line);
+		y -= 14;
+	}
+	glColor3f(1.0f, 1.0f, 1.0f);
+}
+
+//TERRAIN
+//Chunked quadtree cube-sphere terrain for bodies the camera is close to.
+//Every body is a cube whose six faces are quadtrees; each node is a chunk
+//of CHUNK_GRID x CHUNK_GRID vertices projected onto the sphere and
+//displaced by a heightmap or procedural noise. Chunks are generated on
+//the job system, uploaded by the GLUT thread, and kept in a bounded LRU
+//cache. Nodes are split while their screen-space error is too large and
+//the cache has room for their children.
+const int CHUNK_GRID = 17;                 //Vertices per chunk side.
+const int CHUNK_MAX_LEVEL = 10;
+const int MAX_RESIDENT_CHUNKS = 768;
+const int MAX_CHUNK_REQUESTS = 32;         //Chunks being generated at once.
+const int MAX_CHUNK_UPLOADS = 8;           //Chunk uploads per frame.
+const float TERRAIN_RANGE = 6.0f;          //Terrain is used within this many radii.
+const float TERRAIN_HEIGHT = 0.01f;        //Displacement relative to the radius.
+//Grid vertices plus skirt vertices, each position and texcoord.
+const int CHUNK_VERTEX_FLOATS = (CHUNK_GRID * CHUNK_GRID + 4 * CHUNK_GRID) * 5;
+
+enum ChunkState { CHUNK_REQUESTED, CHUNK_GENERATED, CHUNK_UPLOADED };
+
+//Staging memory for the vertices of a chunk until it is uploaded.
+struct ChunkVertices {
+	float data[CHUNK_VERTEX_FLOATS];
+};
+
+struct TerrainChunk {
+	int body;
+	int face;
+	int level;
+	int x;
+	int y;
+	float radius;                //Body radius when the chunk was requested.
+	glm::vec3 center;            //Body-local bounding sphere.
+	float boundingRadius;
+	float geometricError;        //In the same units as the body radius.
+	ChunkVertices *vertices;     //Position and texcoord; released after the upload.
+	GLuint vbo;
+	std::atomic<int> state;
+	long lastUsed;
+	double requestedAt;
+	double latencyMs;            //From the request until the vertices were ready.
+};
+
+//Optional heightmaps, Textures/<body>_height.png. Bodies without one use
+//procedural noise.
+Image_t heightmaps[NUM_BODIES];
+
+std::map<unsigned long long, TerrainChunk *> terrainChunks;
+//Chunks and their staging vertices are recycled, chunks come and go
+//all the time while the camera moves. Only used by the GLUT thread.
+Pool<TerrainChunk> chunkPool;
+Pool<ChunkVertices> chunkVertexPool;
+std::vector<TerrainChunk *> terrainDrawList[NUM_BODIES];
+GLuint terrainIndexBuffer = 0;
+int terrainIndexCount = 0;
+int terrainRequests = 0;
+long terrainFrame = 0;
+int terrainUsed = 0;                       //Chunks used by the current frame.
+double terrainLatencyMs = 0.0;
+
+unsigned long long chunkKey(int body, int face, int level, int x, int y)
+{
+	return ((unsigned long long)body << 56) | ((unsigned long long)face << 48) |
+	       ((unsigned long long)level << 40) | ((unsigned long long)x << 20) | (unsigned long long)y;
+}
+
+//Maps a point of a cube face, u and v in [-1, 1], to the unit sphere.
+glm::vec3 cubeToSphere(int face, float u, float v)
+{
+	glm::vec3 p;
+	switch (face)
+	{
+	case 0: p = glm::vec3( 1.0f, v, -u); break;
+	case 1: p = glm::vec3(-1.0f, v,  u); break;
+	case 2: p = glm::vec3(u,  1.0f, -v); break;
+	case 3: p = glm::vec3(u, -1.0f,  v); break;
+	case 4: p = glm::vec3(u, v,  1.0f); break;
+	default: p = glm::vec3(-u, v, -1.0f); break;
+	}
+	return glm::normalize(p);
+}
+
+//Texture coordinates of a direction, matching the mapping of gluSphere
+//(pole on the Z axis, s starting on the +Y axis).
+glm::vec2 sphereTexcoord(const glm::vec3 &d)
+{
+	float s = atan2(-d.x, d.y) / (2.0f * 3.14159265f);
+	if (s < 0.0f)
+		s += 1.0f;
+	float t = 1.0f - acos(glm::clamp(d.z, -1.0f, 1.0f)) / 3.14159265f;
+	return glm::vec2(s, t);
+}
+
+float latticeValue(int x, int y, int z, int seed)
+{
+	unsigned int h = x * 374761393u + y * 668265263u + z * 2147483647u + seed * 1274126177u;
+	h = (h ^ (h >> 13)) * 1274126177u;
+	return (h ^ (h >> 16)) / 4294967295.0f;
+}
+
+float smoothstepf(float t) { return t * t * (3.0f - 2.0f * t); }
+
+//Trilinearly interpolated value noise in [0, 1].
+float valueNoise(const glm::vec3 &p, int seed)
+{
+	int x = (int)floor(p.x), y = (int)floor(p.y), z = (int)floor(p.z);
+	float fx = smoothstepf(p.x - x), fy = smoothstepf(p.y - y), fz = smoothstepf(p.z - z);
+	float c[2][2];
+	for (int j = 0; j < 2; j++)
+		for (int k = 0; k < 2; k++)
+			c[j][k] = glm::mix(latticeValue(x, y + j, z + k, seed), latticeValue(x + 1, y + j, z + k, seed), fx);
+	return glm::mix(glm::mix(c[0][0], c[1][0], fy), glm::mix(c[0][1], c[1][1], fy), fz);
+}
+
+//Height of the surface in [0, 1] in the given direction.
+float terrainHeight(int body, const glm::vec3 &d)
+{
+	const Image_t &map = heightmaps[body];
+	if (!map.data.empty())
+	{
+		glm::vec2 st = sphereTexcoord(d);
+		int px = std::min((int)(st.x * map.width), map.width - 1);
+		int py = std::min((int)((1.0f - st.y) * map.height), map.height - 1);
+		return map.data[(py * map.width + px) * 4] / 255.0f;
+	}
+	float height = 0.0f, amplitude = 0.5f;
+	glm::vec3 p = d * 4.0f;
+	for (int octave = 0; octave < 6; octave++)
+	{
+		height += amplitude * valueNoise(p, body);
+		p = p * 2.0f;
+		amplitude *= 0.5f;
+	}
+	return height;
+}
+
+//Builds the vertices of a chunk. Runs on the job system; only touches the
+//chunk until it is marked as generated.
+void generateChunk(TerrainChunk *chunk)
+{
+	float radius = chunk->radius;
+	float size = 2.0f / (1 << chunk->level);
+	float u0 = -1.0f + chunk->x * size;
+	float v0 = -1.0f + chunk->y * size;
+	float skirt = chunk->geometricError * 2.0f;
+
+	//Grid vertices followed by one skirt vertex per edge vertex. The
+	//skirts hang down below the surface to hide cracks between levels.
+	float *out = chunk->vertices->data;
+	float minS = 1.0f, maxS = 0.0f;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int j = 0; j < CHUNK_GRID; j++)
+			for (int i = 0; i < CHUNK_GRID; i++)
+			{
+				bool edge = (i == 0 || j == 0 || i == CHUNK_GRID - 1 || j == CHUNK_GRID - 1);
+				if (pass == 1 && !edge)
+					continue;
+				glm::vec3 d = cubeToSphere(chunk->face, u0 + size * i / (CHUNK_GRID - 1), v0 + size * j / (CHUNK_GRID - 1));
+				float r = radius * (1.0f + TERRAIN_HEIGHT * terrainHeight(chunk->body, d)) - (pass == 1 ? skirt : 0.0f);
+				glm::vec2 st = sphereTexcoord(d);
+				minS = std::min(minS, st.x);
+				maxS = std::max(maxS, st.x);
+				*out++ = d.x * r; *out++ = d.y * r; *out++ = d.z * r;
+				*out++ = st.x; *out++ = st.y;
+			}
+	}
+	//Chunks crossing the texture seam would interpolate across the whole
+	//texture; shift their low s values by one (the textures repeat).
+	if (maxS - minS > 0.5f)
+		for (int v = 3; v < CHUNK_VERTEX_FLOATS; v += 5)
+			if (chunk->vertices->data[v] < 0.5f)
+				chunk->vertices->data[v] += 1.0f;
+
+	chunk->latencyMs = nowMs() - chunk->requestedAt;
+	chunk->state.store(CHUNK_GENERATED, std::memory_order_release);
+}
+
+//Index buffer shared by all chunks, they all have the same topology.
+void createTerrainIndexBuffer(void)
+{
+	std::vector<GLuint> indices;
+	for (int j = 0; j < CHUNK_GRID - 1; j++)
+		for (int i = 0; i < CHUNK_GRID - 1; i++)
+		{
+			GLuint a = j * CHUNK_GRID + i, b = a + 1, c = a + CHUNK_GRID, d = c + 1;
+			indices.push_back(a); indices.push_back(b); indices.push_back(d);
+			indices.push_back(a); indices.push_back(d); indices.push_back(c);
+		}
+
+	//Skirt vertices are stored in the same order as the edge vertices
+	//appear in the grid.
+	std::map<GLuint, GLuint> skirtOf;
+	GLuint next = CHUNK_GRID * CHUNK_GRID;
+	for (int j = 0; j < CHUNK_GRID; j++)
+		for (int i = 0; i < CHUNK_GRID; i++)
+			if (i == 0 || j == 0 || i == CHUNK_GRID - 1 || j == CHUNK_GRID - 1)
+				skirtOf[j * CHUNK_GRID + i] = next++;
+	for (int k = 0; k < CHUNK_GRID - 1; k++)
+	{
+		GLuint edges[4][2] = {
+			{ (GLuint)k, (GLuint)(k + 1) },                                                       //Bottom
+			{ (GLuint)((CHUNK_GRID - 1) * CHUNK_GRID + k), (GLuint)((CHUNK_GRID - 1) * CHUNK_GRID + k + 1) }, //Top
+			{ (GLuint)(k * CHUNK_GRID), (GLuint)((k + 1) * CHUNK_GRID) },                         //Left
+			{ (GLuint)(k * CHUNK_GRID + CHUNK_GRID - 1), (GLuint)((k + 1) * CHUNK_GRID + CHUNK_GRID - 1) }, //Right
+		};
+		for (int e = 0; e < 4; e++)
+		{
+			GLuint a = edges[e][0], b = edges[e][1];
+			indices.push_back(a); indices.push_back(b); indices.push_back(skirtOf[b]);
+			indices.push_back(a); indices.push_back(skirtOf[b]); indices.push_back(skirtOf[a]);
+		}
+	}
+
+	glGenBuffers(1, &terrainIndexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainIndexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	terrainIndexCount = (int)indices.size();
+}
+
+//Returns the chunk for the node, requesting its generation if it is not
+//in the cache yet. Returns NULL while the chunk is not drawable.
+TerrainChunk *findChunk(int body, int face, int level, int x, int y)
+{
+	unsigned long long key = chunkKey(body, face, level, x, y);
+	std::map<unsigned long long, TerrainChunk *>::iterator it = terrainChunks.find(key);
+	if (it != terrainChunks.end())
+	{
+		if (it->second->lastUsed != terrainFrame)
+			terrainUsed++;
+		it->second->lastUsed = terrainFrame;
+		return (it->second->state.load(std::memory_order_acquire) == CHUNK_UPLOADED ? it->second : NULL);
+	}
+	if (terrainRequests >= MAX_CHUNK_REQUESTS)
+		return NULL;
+
+	TerrainChunk *chunk = chunkPool.acquire();
+	chunk->body = body;
+	chunk->face = face;
+	chunk->level = level;
+	chunk->x = x;
+	chunk->y = y;
+	float size = 2.0f / (1 << level);
+	float u = -1.0f + (x + 0.5f) * size, v = -1.0f + (y + 0.5f) * size;
+	float radius = bodies[body].radius;
+	chunk->radius = radius;
+	chunk->center = cubeToSphere(face, u, v) * radius;
+	chunk->boundingRadius = glm::length(cubeToSphere(face, u - size * 0.5f, v - size * 0.5f) * radius - chunk->center) +
+	                        radius * TERRAIN_HEIGHT;
+	chunk->geometricError = radius * (size / (CHUNK_GRID - 1) + TERRAIN_HEIGHT / (1 << level));
+	chunk->vertices = chunkVertexPool.acquire();
+	chunk->vbo = 0;
+	chunk->state = CHUNK_REQUESTED;
+	chunk->lastUsed = terrainFrame;
+	chunk->requestedAt = nowMs();
+	chunk->latencyMs = 0.0;
+	terrainChunks[key] = chunk;
+	terrainUsed++;
+	terrainRequests++;
+	jobs.submit([chunk]() { generateChunk(chunk); }, NULL);
+	return NULL;
+}
+
+//Gives a chunk that is not being generated back to the pools.
+void releaseChunk(TerrainChunk *chunk)
+{
+	if (chunk->vbo)
+		glDeleteBuffers(1, &chunk->vbo);
+	if (chunk->vertices)
+		chunkVertexPool.release(chunk->vertices);
+	chunkPool.release(chunk);
+}
+
+//Uploads generated chunks and evicts the least recently used ones above
+//the cache budget. Chunks still being generated are never evicted.
+void updateTerrainCache(void)
+{
+	int uploads = 0;
+	FrameArena::Scope scope(frameArena);
+	std::pair<long, unsigned long long> *evictable =
+		frameArena.allocate<std::pair<long, unsigned long long> >(terrainChunks.size());
+	int numEvictable = 0;
+	for (std::map<unsigned long long, TerrainChunk *>::iterator it = terrainChunks.begin();
+	     it != terrainChunks.end(); )
+	{
+		TerrainChunk *chunk = it->second;
+		int state = chunk->state.load(std::memory_order_acquire);
+		//Chunks that were being generated while the radius of their body
+		//changed (see flushTerrain()) are out of date; drop them.
+		if (state == CHUNK_GENERATED && chunk->radius != bodies[chunk->body].radius)
+		{
+			terrainRequests--;
+			releaseChunk(chunk);
+			terrainChunks.erase(it++);
+			continue;
+		}
+		if (state == CHUNK_GENERATED && uploads < MAX_CHUNK_UPLOADS)
+		{
+			glGenBuffers(1, &chunk->vbo);
+			glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(ChunkVertices), chunk->vertices->data, GL_STATIC_DRAW);
+			chunkVertexPool.release(chunk->vertices);
+			chunk->vertices = NULL;
+			chunk->state = CHUNK_UPLOADED;
+			terrainLatencyMs = glm::mix(terrainLatencyMs, chunk->latencyMs, 0.1);
+			terrainRequests--;
+			uploads++;
+		}
+		if (state != CHUNK_REQUESTED && chunk->lastUsed != terrainFrame)
+			evictable[numEvictable++] = std::make_pair(chunk->lastUsed, it->first);
+		++it;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	int excess = (int)terrainChunks.size() - MAX_RESIDENT_CHUNKS;
+	if (excess > 0)
+	{
+		std::sort(evictable, evictable + numEvictable);
+		for (int i = 0; i < excess && i < numEvictable; i++)
+		{
+			TerrainChunk *chunk = terrainChunks[evictable[i].second];
+			if (chunk->state == CHUNK_GENERATED)
+				terrainRequests--;
+			releaseChunk(chunk);
+			terrainChunks.erase(evictable[i].second);
+		}
+	}
+
+	size_t vertexBytes = sizeof(ChunkVertices);
+	profiler.set("terrain chunks", terrainChunks.size());
+	profiler.set("terrain resident KB", (terrainChunks.size() * vertexBytes + terrainIndexCount * sizeof(GLuint)) / 1024.0);
+	profiler.set("terrain gen latency ms", terrainLatencyMs);
+}
+
+//Transforms a body-local point to render space the way drawBody()
+//orients the body.
+glm::vec3 bodyToRender(const DrawItem &item, const glm::vec3 &p)
+{
+	float spin = glm::radians(item.rotation), tilt = glm::radians(7.0f + item.tilt);
+	glm::vec3 q(p.x * cos(spin) - p.y * sin(spin), p.x * sin(spin) + p.y * cos(spin), p.z);
+	return toRender(item.position) + glm::vec3(q.x, q.y * cos(tilt) - q.z * sin(tilt), q.y * sin(tilt) + q.z * cos(tilt));
+}
+
+//Collects the chunks to draw for a node into terrainDrawList. A node is
+//only split once its own chunk is resident, and only replaced by its
+//children once all four of them are. Returns false if the node has
+//nothing to draw yet.
+bool selectChunks(int body, const DrawItem &item, const Frustum &frustum,
+                  float pixelsPerRadian, int face, int level, int x, int y)
+{
+	float radius = bodies[body].radius;
+	float size = 2.0f / (1 << level);
+	float u = -1.0f + (x + 0.5f) * size, v = -1.0f + (y + 0.5f) * size;
+	glm::vec3 direction = cubeToSphere(face, u, v);
+	float boundingRadius = glm::length(cubeToSphere(face, u - size * 0.5f, v - size * 0.5f) - direction) * radius +
+	                       radius * TERRAIN_HEIGHT;
+	glm::vec3 center = bodyToRender(item, direction * radius);
+	glm::vec3 bodyCenter = toRender(item.position);
+
+	//Horizon culling: the node is hidden if its angular distance from the
+	//sub-camera point exceeds the horizon angle plus the node's extent.
+	glm::vec3 toCamera = -bodyCenter; //The camera is the render space origin.
+	float distance = glm::length(toCamera);
+	if (distance > radius)
+	{
+		float horizon = acos(radius / distance);
+		float extent = asin(std::min(1.0f, boundingRadius / radius));
+		float angle = acos(glm::clamp(glm::dot(glm::normalize(center - bodyCenter), toCamera / distance), -1.0f, 1.0f));
+		if (angle > horizon + extent)
+			return true;
+	}
+	if (!sphereInFrustum(frustum, center, boundingRadius))
+		return true;
+
+	TerrainChunk *chunk = findChunk(body, face, level, x, y);
+	if (chunk == NULL)
+		return false;
+
+	float nodeDistance = std::max(glm::length(center) - boundingRadius, 1e-4f);
+	float screenError = chunk->geometricError / nodeDistance * pixelsPerRadian;
+	//Chunks used this frame and chunks being generated can not be evicted,
+	//so refinement stops before the four children could overflow the cache.
+	bool budget = terrainUsed + 4 <= MAX_RESIDENT_CHUNKS - MAX_CHUNK_REQUESTS;
+	if (screenError > quality().terrainError && level < CHUNK_MAX_LEVEL && budget)
+	{
+		std::vector<TerrainChunk *> &list = terrainDrawList[body];
+		size_t mark = list.size();
+		bool ready = true;
+		for (int child = 0; child < 4; child++)
+			ready = selectChunks(body, item, frustum, pixelsPerRadian, face, level + 1,
+			                     x * 2 + (child & 1), y * 2 + (child >> 1)) && ready;
+		if (ready)
+			return true;
+		list.resize(mark);
+	}
+	terrainDrawList[body].push_back(chunk);
+	return true;
+}
+
+//Selects the terrain chunks of the bodies close to the camera. Bodies
+//whose terrain is not ready yet keep being drawn as plain spheres.
+void updateTerrain(const FrameState &frame)
+{
+	terrainFrame++;
+	terrainUsed = 0;
+	Frustum frustum = currentFrustum();
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	float pixelsPerRadian = viewport[3] / (2.0f * tan(glm::radians(90.0f) * 0.5f));
+
+	for (int body = 0; body < NUM_BODIES; body++)
+	{
+		terrainDrawList[body].clear();
+		const DrawItem &item = frame.drawList[body];
+		if (glm::length(toRender(item.position)) > TERRAIN_RANGE * bodies[body].radius)
+			continue;
+		bool ready = true;
+		for (int face = 0; face < 6; face++)
+			ready = selectChunks(body, item, frustum, pixelsPerRadian, face, 0, 0, 0) && ready;
+		if (!ready)
+			terrainDrawList[body].clear();
+	}
+	updateTerrainCache();
+}
+
+void drawTerrain(const DrawItem &item, const std::vector<TerrainChunk *> &chunks)
+{
+	glActiveTexture(GL_TEXTURE0);
+    glEnable (GL_TEXTURE_2D);
+    glBindTexture (GL_TEXTURE_2D, textures[item.texture]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glPushMatrix();
+	glm::vec3 position = toRender(item.position);
+	glTranslatef(position.x, position.y, position.z);
+	glRotatef(7,1.0f,0.0f,0.0f);
+	glRotatef(item.tilt,1.0f,0.0f,0.0f);
+    glRotatef(item.rotation,0.0f,0.0f,1.0f);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainIndexBuffer);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, chunks[i]->vbo);
+		glVertexPointer(3, GL_FLOAT, 5 * sizeof(float), (const GLvoid *)0);
+		glTexCoordPointer(2, GL_FLOAT, 5 * sizeof(float), (const GLvoid *)(3 * sizeof(float)));
+		glDrawElements(GL_TRIANGLES, terrainIndexCount, GL_UNSIGNED_INT, 0);
+	}
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	glPopMatrix();
+    glDisable(GL_TEXTURE_2D);
+}
+
+//Loads the optional heightmaps and creates the shared chunk indices.
+void initTerrain(std::string const& dirname)
+{
+	for (int body = 0; body < NUM_BODIES; body++)
+	{
+		std::string name = bodies[body].name;
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+		std::string filename = dirname + "/" + name + "_height.png";
+		if (std::ifstream(filename.c_str()).good())
+			heightmaps[body] = loadPNG(filename);
+	}
+	createTerrainIndexBuffer();
+}
+
+//Feeds the positions of the bodies and particles of a newly simulated
+//step into the trail ring buffer.
+void updateTrails(const FrameState &frame)
+{
+	if (frame.step == trails.lastStep)
+		return;
+	trails.lastStep = frame.step;
+	static std::vector<glm::vec3> positions;
+	static std::vector<unsigned> generations;
+	positions.clear();
+	generations.clear();
+	for (size_t i = 0; i < frame.drawList.size(); i++)
+	{
+		positions.push_back(glm::vec3(frame.drawList[i].position - camera.eye));
+		generations.push_back(frame.drawList[i].generation);
+	}
+	for (size_t i = 0; i < frame.spriteList.size(); i++)
+	{
+		positions.push_back(glm::vec3(frame.spriteList[i].position - camera.eye));
+		generations.push_back(frame.spriteList[i].generation);
+	}
+	double start = nowMs();
+	pushTrails(&trails, &positions[0], camera.eye, &generations[0], (int)positions.size());
+	profiler.set("trail upload ms", nowMs() - start);
+}
+
+//HOT RELOAD
+//A watcher thread follows the shader, texture and root directories with
+//inotify. Changed shaders are recompiled and changed body parameters
+//applied by the GLUT thread at the start of the next frame. Changed
+//textures are decoded on the job system first, so the GLUT thread only
+//pays for the upload.
+struct DecodedTexture {
+	int texture;
+	Image_t image;
+};
+
+//One line of the body configuration. The name is only matched against
+//the bodies by the GLUT thread, see mergeBodyConfig().
+struct BodyConfig {
+	std::string name;
+	int lineNumber;
+	BodyParams params;
+};
+
+struct ReloadQueue {
+	std::mutex lock;
+	std::vector<std::string> shaders;          //Changed shader files.
+	std::vector<DecodedTexture> textures;
+	std::vector<BodyConfig> bodies;            //Parsed configuration, empty if unchanged.
+};
+
+ReloadQueue reloads;
+std::thread watcherThread;
+std::atomic<bool> watching(false);
+
+//Parses the body configuration. Each line is
+//  name orbitRadius eccentricity periapsis orbitSpeed orbitScale spinSpeed radius
+//with # starting a comment. Runs on the watcher thread, so it only reads
+//the file and does not touch bodies[].
+bool parseBodyConfig(const std::string &filename, std::vector<BodyConfig> *result)
+{
+	std::ifstream file(filename.c_str());
+	if (!file.good())
+		return false;
+	result->clear();
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line))
+	{
+		lineNumber++;
+		line = line.substr(0, line.find('#'));
+		std::istringstream stream(line);
+		BodyConfig config;
+		if (!(stream >> config.name))
+			continue;
+		config.lineNumber = lineNumber;
+		BodyParams &params = config.params;
+		if (!(stream >> params.orbitRadius >> params.eccentricity >> params.periapsis
+		             >> params.orbitSpeed >> params.orbitScale >> params.spinSpeed >> params.radius))
+		{
+			std::cerr << "Error: " << filename << ":" << lineNumber << ": invalid body line." << std::endl;
+			return false;
+		}
+		result->push_back(config);
+	}
+	return true;
+}
+
+//Fills result with the current bodies changed by the configuration.
+//Bodies missing from it keep their values. Only called by the GLUT
+//thread, which owns bodies[].
+bool mergeBodyConfig(const std::vector<BodyConfig> &config, BodyParams *result)
+{
+	std::copy(bodies, bodies + NUM_BODIES, result);
+	for (size_t i = 0; i < config.size(); i++)
+	{
+		int body = -1;
+		for (int j = 0; j < NUM_BODIES; j++)
+			if (config[i].name == bodies[j].name)
+				body = j;
+		if (body < 0)
+		{
+			std::cerr << "Error: bodies.cfg:" << config[i].lineNumber << ": unknown body " << config[i].name << "."
+			          << std::endl;
+			return false;
+		}
+		BodyParams params = config[i].params;
+		params.name = bodies[body].name;
+		params.texture = bodies[body].texture;
+		result[body] = params;
+	}
+	return true;
+}
+
+void watchFiles(void)
+{
+	int fd = inotify_init1(IN_NONBLOCK);
+	if (fd < 0) {
+		std::cerr << "Error: Could not start the file watcher." << std::endl;
+		return;
+	}
+	std::string root = getEnvVar("ASSIGNMENT3_ROOT");
+	int shaderWatch = inotify_add_watch(fd, shaderDir().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	int textureWatch = inotify_add_watch(fd, textureDir().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	int rootWatch = inotify_add_watch(fd, root.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (watching)
+	{
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		ssize_t length = read(fd, buffer, sizeof(buffer));
+		for (ssize_t offset = 0; offset < length; )
+		{
+			const struct inotify_event *event = (const struct inotify_event *)(buffer + offset);
+			offset += sizeof(struct inotify_event) + event->len;
+			if (event->len == 0)
+				continue;
+			std::string name = event->name;
+			if (event->wd == shaderWatch)
+			{
+				std::lock_guard<std::mutex> guard(reloads.lock);
+				reloads.shaders.push_back(shaderDir() + name);
+			}
+			else if (event->wd == textureWatch)
+			{
+				for (int i = 0; i < NUM_TEXTURES; i++)
+				{
+					if (name != textureFiles[i])
+						continue;
+					std::string filename = textureDir() + name;
+					jobs.submit([i, filename]() {
+						DecodedTexture decoded;
+						decoded.texture = i;
+						if (!decodePNG(filename, &decoded.image))
+							return; //Probably still being written, wait for the next event.
+						std::lock_guard<std::mutex> guard(reloads.lock);
+						reloads.textures.push_back(decoded);
+					}, NULL);
+				}
+			}
+			else if (event->wd == rootWatch && name == "bodies.cfg")
+			{
+				std::vector<BodyConfig> parsed;
+				if (parseBodyConfig(root + "/bodies.cfg", &parsed) && !parsed.empty())
+				{
+					std::lock_guard<std::mutex> guard(reloads.lock);
+					reloads.bodies = parsed;
+				}
+			}
+		}
+	}
+	close(fd);
+}
+
+void startFileWatcher(void)
+{
+	watching = true;
+	watcherThread = std::thread(watchFiles);
+}
+
+void stopFileWatcher(void)
+{
+	watching = false;
+	if (watcherThread.joinable())
+		watcherThread.join();
+}
+
+//Drops all terrain chunks that are not being generated, e.g. after the
+//radius of a body changed.
+void flushTerrain(void)
+{
+	for (std::map<unsigned long long, TerrainChunk *>::iterator it = terrainChunks.begin();
+	     it != terrainChunks.end(); )
+	{
+		TerrainChunk *chunk = it->second;
+		if (chunk->state == CHUNK_REQUESTED) {
+			++it;
+			continue;
+		}
+		if (chunk->state == CHUNK_GENERATED)
+			terrainRequests--;
+		releaseChunk(chunk);
+		terrainChunks.erase(it++);
+	}
+	for (int body = 0; body < NUM_BODIES; body++)
+		terrainDrawList[body].clear();
+}
+
+//Applies pending reloads. Called by the GLUT thread before the next
+//simulation step is started. Never waits for the watcher: if the queue
+//is busy the reloads are picked up next frame.
+void applyReloads(void)
+{
+	std::vector<std::string> shaders;
+	std::vector<DecodedTexture> decoded;
+	std::vector<BodyConfig> config;
+	{
+		std::unique_lock<std::mutex> guard(reloads.lock, std::try_to_lock);
+		if (!guard.owns_lock())
+			return;
+		shaders.swap(reloads.shaders);
+		decoded.swap(reloads.textures);
+		config.swap(reloads.bodies);
+	}
+	if (shaders.empty() && decoded.empty() && config.empty())
+		return;
+
+	double start = nowMs();
+	for (size_t i = 0; i < shaderPrograms.size(); i++)
+	{
+		ShaderProgramSource &source = shaderPrograms[i];
+		bool changed = false;
+		for (size_t j = 0; j < shaders.size(); j++)
+			changed = changed || shaders[j] == source.vertexShaderFilename || shaders[j] == source.fragmentShaderFilename;
+		if (!changed)
+			continue;
+		//Compile into a new program object, so that the old program is
+		//kept if the new sources do not compile. On success the new object
+		//is installed as it is, the one that was validated, and the old
+		//one is deleted. GLSLProgram objects are never copied.
+		cgtk::GLSLProgram *program = new cgtk::GLSLProgram;
+		if (compileShaderProgram(source.vertexShaderFilename, source.fragmentShaderFilename, program)) {
+			deleteShaderProgram(*source.program);
+			*source.program = program;
+			std::cout << "Reloaded " << source.fragmentShaderFilename << std::endl;
+		}
+		else {
+			deleteShaderProgram(program);
+			std::cerr << "Error: Could not reload " << source.fragmentShaderFilename << ", keeping the old program." << std::endl;
+		}
+	}
+
+	for (size_t i = 0; i < decoded.size(); i++)
+	{
+		uploadTexture(decoded[i].texture, decoded[i].image);
+		std::cout << "Reloaded " << textureFiles[decoded[i].texture] << std::endl;
+	}
+
+	//The simulation job reads the body table, so it is only changed
+	//while no step is running. Otherwise try again next frame.
+	BodyParams params[NUM_BODIES];
+	if (!config.empty())
+	{
+		if (simulationInFlight)
+		{
+			std::lock_guard<std::mutex> guard(reloads.lock);
+			if (reloads.bodies.empty())
+				reloads.bodies = config;
+		}
+		else if (mergeBodyConfig(config, params))
+		{
+			bool radiusChanged = false;
+			for (int i = 0; i < NUM_BODIES; i++)
+			{
+				radiusChanged = radiusChanged || params[i].radius != bodies[i].radius;
+				bodies[i] = params[i];
+			}
+			createOrbits();
+			if (radiusChanged)
+				flushTerrain();
+			std::cout << "Reloaded the body configuration." << std::endl;
+		}
+	}
+	profiler.set("reload ms", nowMs() - start);
+}
+
+//VIDEO EXPORT
+//Renders at a fixed frame rate and resolution into an offscreen target
+//and writes every frame, either as a PNG sequence or a raw Y4M video.
+//Frames are read back through a ring of pixel buffer objects: the read
+//of frame n is only mapped once its fence has passed, a few frames
+//later, so the GPU never waits for the CPU. A mapped buffer goes
+//straight to the encoder threads and is unmapped when they are done, so
+//the pixels are not copied on the GLUT thread. When the encoders fall
+//behind, the GLUT thread waits for them instead of dropping frames.
+enum ExportSlotState { SLOT_FREE, SLOT_READING, SLOT_ENCODING, SLOT_DONE };
+
+struct ExportSlot {
+	GLuint pbo;
+	GLsync fence;
+	std::atomic<int> state;
+	const unsigned char *pixels;  //Mapped while encoding.
+	long frame;
+};
+
+struct Exporter {
+	Exporter() : active(false), y4m(false), width(1920), height(1080), fps(60), frames(600),
+	             slots(NULL), numSlots(0), stopping(false), y4mFile(NULL) {}
+	bool active;
+	std::string path;      //Directory of the PNG sequence, or the .y4m file.
+	bool y4m;
+	int width, height, fps;
+	long frames;           //Frames to export.
+	long issued, encoded;
+	double startMs;
+	GLuint fbo, color;
+	ExportSlot *slots;
+	int numSlots;
+	int next;              //Slot of the next readback.
+	int oldest;            //Oldest slot being read back.
+	std::deque<int> queue; //Slots waiting for an encoder, in frame order.
+	std::mutex lock;
+	std::condition_variable work, done;
+	std::vector<std::thread> encoders;
+	bool stopping;
+	FILE *y4mFile;
+	std::string error;     //First failure, empty while everything works.
+};
+
+Exporter exporter;
+
+//Records the first failure. No more frames are issued or written after it.
+void failExport(const std::string &message)
+{
+	std::lock_guard<std::mutex> guard(exporter.lock);
+	if (exporter.error.empty())
+		exporter.error = message;
+}
+
+bool exportFailed(void)
+{
+	std::lock_guard<std::mutex> guard(exporter.lock);
+	return !exporter.error.empty();
+}
+
+//Writes a bottom-up RGBA frame as 4:2:0 BT.709 limited range YUV.
+bool writeY4MFrame(FILE *file, const unsigned char *rgba, int width, int height, std::vector<unsigned char> &yuv)
+{
+	yuv.resize(width * height * 3 / 2);
+	unsigned char *Y = &yuv[0], *U = Y + width * height, *V = U + width * height / 4;
+	for (int y = 0; y < height; y += 2)
+		for (int x = 0; x < width; x += 2)
+		{
+			int r = 0, g = 0, b = 0;
+			for (int dy = 0; dy < 2; dy++)
+				for (int dx = 0; dx < 2; dx++)
+				{
+					const unsigned char *p = rgba + ((height - 1 - y - dy) * width + x + dx) * 4;
+					Y[(y + dy) * width + x + dx] = 16 + ((47 * p[0] + 157 * p[1] + 16 * p[2] + 128) >> 8);
+					r += p[0];
+					g += p[1];
+					b += p[2];
+				}
+			int chroma = (y / 2) * (width / 2) + x / 2;
+			U[chroma] = (-26 * r - 87 * g + 112 * b + 512 + (128 << 10)) >> 10;
+			V[chroma] = (112 * r - 102 * g - 10 * b + 512 + (128 << 10)) >> 10;
+		}
+	return fputs("FRAME\n", file) != EOF && fwrite(&yuv[0], 1, yuv.size(), file) == yuv.size();
+}
+
+bool writePNGFrame(const std::string &filename, const unsigned char *rgba, int width, int height,
+                   std::vector<unsigned char> &rgb, std::string *message)
+{
+	//PNG rows go top-down and the alpha is dropped.
+	rgb.resize(width * height * 3);
+	for (int y = 0; y < height; y++)
+	{
+		const unsigned char *row = rgba + (height - 1 - y) * width * 4;
+		unsigned char *out = &rgb[y * width * 3];
+		for (int x = 0; x < width; x++)
+		{
+			out[x * 3 + 0] = row[x * 4 + 0];
+			out[x * 3 + 1] = row[x * 4 + 1];
+			out[x * 3 + 2] = row[x * 4 + 2];
+		}
+	}
+	unsigned error = lodepng::encode(filename, &rgb[0], width, height, LCT_RGB);
+	if (error)
+		*message = filename + ": " + lodepng_error_text(error);
+	return error == 0;
+}
+
+void encodeFrames(void)
+{
+	std::vector<unsigned char> scratch;
+	for (;;)
+	{
+		int index;
+		bool failed;
+		{
+			std::unique_lock<std::mutex> guard(exporter.lock);
+			exporter.work.wait(guard, [] { return exporter.stopping || !exporter.queue.empty(); });
+			if (exporter.queue.empty())
+				return;
+			index = exporter.queue.front();
+			exporter.queue.pop_front();
+			failed = !exporter.error.empty();
+		}
+		//The frames after a failure are dropped.
+		ExportSlot &slot = exporter.slots[index];
+		std::string message;
+		if (!failed && exporter.y4m)
+		{
+			if (!writeY4MFrame(exporter.y4mFile, slot.pixels, exporter.width, exporter.height, scratch))
+				message = "Could not write " + exporter.path + ": " + strerror(errno);
+		}
+		else if (!failed)
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "/frame_%06ld.png", slot.frame);
+			writePNGFrame(exporter.path + name, slot.pixels, exporter.width, exporter.height, scratch, &message);
+		}
+		std::lock_guard<std::mutex> guard(exporter.lock);
+		if (!message.empty() && exporter.error.empty())
+			exporter.error = message;
+		slot.state = SLOT_DONE;
+		if (!failed && message.empty())
+			exporter.encoded++;
+		exporter.done.notify_all();
+	}
+}
+
+//Unmaps the buffers the encoders are done with.
+void reclaimExportSlots(void)
+{
+	for (int i = 0; i < exporter.numSlots; i++)
+	{
+		ExportSlot &slot = exporter.slots[i];
+		if (slot.state != SLOT_DONE)
+			continue;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		slot.state = SLOT_FREE;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+//Maps the oldest readbacks whose fences have passed and hands them to the
+//encoders, in frame order. With wait, blocks for the oldest one.
+void harvestExportSlots(bool wait)
+{
+	while (exporter.slots[exporter.oldest].state == SLOT_READING)
+	{
+		ExportSlot &slot = exporter.slots[exporter.oldest];
+		GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000ull : 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			return;
+		glDeleteSync(slot.fence);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		slot.pixels = (const unsigned char *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+		                                                      exporter.width * exporter.height * 4, GL_MAP_READ_BIT);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		if (slot.pixels == NULL)
+		{
+			failExport("Could not map the readback of a frame.");
+			slot.state = SLOT_FREE;
+			exporter.oldest = (exporter.oldest + 1) % exporter.numSlots;
+			wait = false;
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> guard(exporter.lock);
+			slot.state = SLOT_ENCODING;
+			exporter.queue.push_back(exporter.oldest);
+		}
+		exporter.work.notify_one();
+		exporter.oldest = (exporter.oldest + 1) % exporter.numSlots;
+		wait = false;
+	}
+}
+
+//Starts exporting to path (a directory, or a file ending in .y4m). PNG
+//encoding is slow, so it gets several encoder threads; Y4M frames must be
+//written in order and get one.
+bool startExport(const std::string &path, int width, int height, int fps, long frames)
+{
+	exporter.path = path;
+	exporter.y4m = path.size() > 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+	exporter.width = width & ~1; //4:2:0 needs even sizes.
+	exporter.height = height & ~1;
+	exporter.fps = fps;
+	exporter.frames = frames;
+	exporter.issued = exporter.encoded = 0;
+	exporter.next = exporter.oldest = 0;
+	exporter.stopping = false;
+	exporter.error.clear();
+	if (!exporter.y4m && mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+	{
+		std::cerr << "Error: Could not create " << path << "." << std::endl;
+		return false;
+	}
+	if (exporter.y4m)
+	{
+		exporter.y4mFile = fopen(path.c_str(), "wb");
+		if (exporter.y4mFile == NULL)
+		{
+			std::cerr << "Error: Could not write " << path << "." << std::endl;
+			return false;
+		}
+		fprintf(exporter.y4mFile, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", exporter.width, exporter.height, fps);
+	}
+	int numEncoders = exporter.y4m ? 1 : std::max(1, (int)std::thread::hardware_concurrency() - 2);
+
+	exporter.color = createTargetTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, exporter.width, exporter.height);
+	glGenFramebuffers(1, &exporter.fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, exporter.fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, exporter.color, 0);
+	checkFramebuffer("Export");
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	//Three frames in flight on the GPU plus one per encoder.
+	exporter.numSlots = numEncoders + 3;
+	exporter.slots = new ExportSlot[exporter.numSlots];
+	for (int i = 0; i < exporter.numSlots; i++)
+	{
+		glGenBuffers(1, &exporter.slots[i].pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, exporter.slots[i].pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, exporter.width * exporter.height * 4, NULL, GL_STREAM_READ);
+		exporter.slots[i].state = SLOT_FREE;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	for (int i = 0; i < numEncoders; i++)
+		exporter.encoders.push_back(std::thread(encodeFrames));
+	exporter.active = true;
+	exporter.startMs = nowMs();
+	return true;
+}
+
+//Queues the readback of the frame in the export target.
+void exportFrame(void)
+{
+	reclaimExportSlots();
+	ExportSlot &slot = exporter.slots[exporter.next];
+	while (slot.state != SLOT_FREE)
+	{
+		if (slot.state == SLOT_READING)
+			harvestExportSlots(true);
+		else
+		{
+			std::unique_lock<std::mutex> guard(exporter.lock);
+			exporter.done.wait(guard, [&] { return slot.state == SLOT_DONE; });
+		}
+		reclaimExportSlots();
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, exporter.fbo);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, exporter.width, exporter.height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.frame = exporter.issued++;
+	slot.state = SLOT_READING;
+	exporter.next = (exporter.next + 1) % exporter.numSlots;
+	harvestExportSlots(false);
+}
+
+//Flushes the remaining frames, stops the encoders and returns the
+//sustained export rate in frames per second.
+double finishExport(void)
+{
+	harvestExportSlots(true);
+	while (exporter.slots[exporter.oldest].state == SLOT_READING)
+		harvestExportSlots(true);
+	{
+		std::lock_guard<std::mutex> guard(exporter.lock);
+		exporter.stopping = true;
+	}
+	exporter.work.notify_all();
+	for (size_t i = 0; i < exporter.encoders.size(); i++)
+		exporter.encoders[i].join();
+	exporter.encoders.clear();
+	double fps = exporter.encoded * 1000.0 / (nowMs() - exporter.startMs);
+
+	reclaimExportSlots();
+	for (int i = 0; i < exporter.numSlots; i++)
+		glDeleteBuffers(1, &exporter.slots[i].pbo);
+	delete[] exporter.slots;
+	exporter.slots = NULL;
+	glDeleteFramebuffers(1, &exporter.fbo);
+	glDeleteTextures(1, &exporter.color);
+	if (exporter.y4mFile != NULL && fclose(exporter.y4mFile) != 0)
+		failExport("Could not write " + exporter.path + ": " + strerror(errno));
+	exporter.y4mFile = NULL;
+	exporter.active = false;
+	return fps;
+}
+
+//CONTROL SOCKET
+//Optional local endpoint for monitoring unattended displays: --control
+//PATH listens on a Unix domain socket, --control PORT on localhost TCP.
+//Clients send one JSON object per line and get one back per line:
+//  {"command": "subscribe", "rate": 10}   Body positions 10 times a second, 0 stops.
+//  {"command": "positions"}               Body positions once.
+//  {"command": "stats"}                   Frame time statistics.
+//  {"command": "seek", "days": 365.25}    Jump to a simulated time.
+//  {"command": "focus", "body": "Mars"}   Fly to a body, by name or number.
+//  {"command": "timescale", "value": 2}   Simulated time per frame, in steps.
+//The server has its own thread. The GLUT thread publishes a snapshot
+//through a triple buffer every frame and takes the commands with
+//try_lock, so neither the telemetry nor the commands ever block drawing.
+struct Telemetry {
+	static const int HISTORY = 120;
+	long frame;                   //Frames drawn.
+	long step;
+	double days;                  //Simulated time.
+	double timeScale;
+	int focus;
+	glm::dvec3 position[NUM_BODIES];
+	float frameMs[HISTORY];       //Intervals of the last frames, oldest first.
+	int numFrames;
+	double gpuMs;
+	double simulateMs;
+	double latencyMs;
+	double renderScale;
+};
+
+//Commands waiting for the GLUT thread. Newer commands replace older ones.
+struct ControlQueue {
+	ControlQueue() : seek(false), seekDays(0.0), setTimeScale(false), timeScale(1.0), focus(-1) {}
+	std::mutex lock;
+	bool seek;
+	double seekDays;
+	bool setTimeScale;
+	double timeScale;
+	int focus;
+};
+
+struct ControlClient {
+	int fd;
+	std::string input;            //Received bytes after the last complete line.
+	std::string output;           //Bytes not sent yet.
+	double rate;                  //Position updates per second, 0 for none.
+	double nextUpdate;
+};
+
+//Only the server thread touches the clients.
+struct ControlServer {
+	ControlServer() : fd(-1), running(false) {}
+	int fd;
+	std::string path;             //Of the Unix domain socket, empty for TCP.
+	std::thread thread;
+	std::atomic<bool> running;
+	std::vector<ControlClient> clients;
+	std::string names[NUM_BODIES]; //Of the bodies, copied at start since the GLUT thread reloads bodies[].
+};
+
+TripleBuffer<Telemetry> telemetry;
+ControlQueue controlQueue;
+ControlServer control;
+
+//Output of a client that reads slower than it subscribed to is dropped
+//beyond this, and its commands are not read until it catches up.
+const size_t MAX_CONTROL_OUTPUT = 1 << 16;
+
+//Fills in the socket address: a port number means localhost TCP,
+//anything else a Unix domain socket path.
+bool controlAddress(const std::string &address, sockaddr_storage *storage, socklen_t *length)
+{
+	memset(storage, 0, sizeof(*storage));
+	if (!address.empty() && address.find_first_not_of("0123456789") == std::string::npos)
+	{
+		sockaddr_in *inet = reinterpret_cast<sockaddr_in *>(storage);
+		inet->sin_family = AF_INET;
+		inet->sin_port = htons((uint16_t)atoi(address.c_str()));
+		inet->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		*length = sizeof(sockaddr_in);
+		return true;
+	}
+	sockaddr_un *local = reinterpret_cast<sockaddr_un *>(storage);
+	if (address.empty() || address.size() >= sizeof(local->sun_path))
+	{
+		std::cerr << "Error: Invalid control socket path " << address << std::endl;
+		return false;
+	}
+	local->sun_family = AF_UNIX;
+	strcpy(local->sun_path, address.c_str());
+	*length = sizeof(sockaddr_un);
+	return true;
+}
+
+//Finds "key": value in a line of JSON and returns the value without
+//quotes. Enough for the flat objects of the protocol.
+bool jsonValue(const std::string &line, const char *key, std::string *value)
+{
+	std::string quoted = std::string("\"") + key + "\"";
+	size_t position = line.find(quoted);
+	if (position == std::string::npos)
+		return false;
+	position = line.find_first_not_of(" \t", position + quoted.size());
+	if (position == std::string::npos || line[position] != ':')
+		return false;
+	position = line.find_first_not_of(" \t", position + 1);
+	if (position == std::string::npos)
+		return false;
+	size_t end;
+	if (line[position] == '"')
+	{
+		end = line.find('"', ++position);
+		if (end == std::string::npos)
+			return false;
+	}
+	else
+	{
+		end = line.find_first_of(",} \t\r", position);
+		if (end == std::string::npos)
+			end = line.size();
+	}
+	*value = line.substr(position, end - position);
+	return true;
+}
+
+bool jsonNumber(const std::string &line, const char *key, double *value)
+{
+	std::string text;
+	if (!jsonValue(line, key, &text))
+		return false;
+	char *end;
+	*value = strtod(text.c_str(), &end);
+	return end != text.c_str() && *end == '\0' && std::isfinite(*value);
+}
+
+void appendPositions(const Telemetry &snapshot, std::string *out)
+{
+	char text[256];
+	snprintf(text, sizeof(text), "{\"type\": \"positions\", \"frame\": %ld, \"step\": %ld, \"days\": %.6f, \"bodies\": [",
+	         snapshot.frame, snapshot.step, snapshot.days);
+	*out += text;
+	for (int i = 0; i < NUM_BODIES; i++)
+	{
+		const glm::dvec3 &p = snapshot.position[i];
+		snprintf(text, sizeof(text), "%s{\"name\": \"%s\", \"x\": %.9g, \"y\": %.9g, \"z\": %.9g}",
+		         i > 0 ? ", " : "", control.names[i].c_str(), p.x, p.y, p.z);
+		*out += text;
+	}
+	*out += "]}\n";
+}
+
+void appendStats(const Telemetry &snapshot, std::string *out)
+{
+	std::vector<float> frames(snapshot.frameMs, snapshot.frameMs + snapshot.numFrames);
+	std::sort(frames.begin(), frames.end());
+	double sum = 0.0;
+	for (size_t i = 0; i < frames.size(); i++)
+		sum += frames[i];
+	double average = frames.empty() ? 0.0 : sum / frames.size();
+	char text[512];
+	snprintf(text, sizeof(text),
+	         "{\"type\": \"stats\", \"frame\": %ld, \"step\": %ld, \"days\": %.6f, \"timeScale\": %g, \"focus\": \"%s\", "
+	         "\"frames\": %d, \"fps\": %.2f, \"frameMs\": {\"average\": %.3f, \"min\": %.3f, \"p95\": %.3f, \"max\": %.3f}, "
+	         "\"gpuMs\": %.3f, \"simulateMs\": %.3f, \"latencyMs\": %.3f, \"renderScale\": %.2f}\n",
+	         snapshot.frame, snapshot.step, snapshot.days, snapshot.timeScale, control.names[snapshot.focus].c_str(),
+	         snapshot.numFrames, average > 0.0 ? 1000.0 / average : 0.0, average,
+	         frames.empty() ? 0.0 : frames.front(), frames.empty() ? 0.0 : frames[(frames.size() * 95) / 100],
+	         frames.empty() ? 0.0 : frames.back(), snapshot.gpuMs, snapshot.simulateMs, snapshot.latencyMs,
+	         snapshot.renderScale);
+	*out += text;
+}
+
+void appendReply(bool ok, const char *message, std::string *out)
+{
+	if (ok)
+		*out += "{\"type\": \"ok\"}\n";
+	else
+		*out += std::string("{\"type\": \"error\", \"message\": \"") + message + "\"}\n";
+}
+
+//Returns the body named or numbered by the text, or -1.
+int findBody(const std::string &text)
+{
+	for (int i = 0; i < NUM_BODIES; i++)
+		if (strcasecmp(text.c_str(), control.names[i].c_str()) == 0)
+			return i;
+	char *end;
+	long number = strtol(text.c_str(), &end, 10);
+	if (end == text.c_str() || *end != '\0' || number < 0 || number >= NUM_BODIES)
+		return -1;
+	return (int)number;
+}
+
+//Runs one command line of a client on the server thread.
+void handleControlLine(ControlClient &client, const std::string &line)
+{
+	std::string command, text;
+	double value;
+	if (!jsonValue(line, "command", &command))
+	{
+		appendReply(false, "missing command", &client.output);
+	}
+	else if (command == "subscribe")
+	{
+		bool valid = jsonNumber(line, "rate", &value) && value >= 0.0;
+		if (valid)
+		{
+			client.rate = std::min(value, 240.0);
+			client.nextUpdate = nowMs();
+		}
+		appendReply(valid, "rate must be a number of updates per second", &client.output);
+	}
+	else if (command == "positions" || command == "stats")
+	{
+		telemetry.acquire();
+		if (command == "positions")
+			appendPositions(telemetry.readSlot(), &client.output);
+		else
+			appendStats(telemetry.readSlot(), &client.output);
+	}
+	else if (command == "seek")
+	{
+		bool valid = jsonNumber(line, "days", &value);
+		if (valid)
+		{
+			std::lock_guard<std::mutex> guard(controlQueue.lock);
+			controlQueue.seek = true;
+			controlQueue.seekDays = value;
+		}
+		appendReply(valid, "days must be a number", &client.output);
+	}
+	else if (command == "focus")
+	{
+		int body = (jsonValue(line, "body", &text) ? findBody(text) : -1);
+		if (body >= 0)
+		{
+			std::lock_guard<std::mutex> guard(controlQueue.lock);
+			controlQueue.focus = body;
+		}
+		appendReply(body >= 0, "unknown body", &client.output);
+	}
+	else if (command == "timescale")
+	{
+		bool valid = jsonNumber(line, "value", &value) && fabs(value) <= 1000.0;
+		if (valid)
+		{
+			std::lock_guard<std::mutex> guard(controlQueue.lock);
+			controlQueue.setTimeScale = true;
+			controlQueue.timeScale = value;
+		}
+		appendReply(valid, "value must be a number between -1000 and 1000", &client.output);
+	}
+	else
+	{
+		appendReply(false, "unknown command", &client.output);
+	}
+}
+
+//Runs the complete lines received so far while the replies fit into the
+//output limit. The rest waits until the client has read its replies.
+void runControlLines(ControlClient &client)
+{
+	size_t end;
+	while (client.output.size() < MAX_CONTROL_OUTPUT && (end = client.input.find('\n')) != std::string::npos)
+	{
+		std::string line = client.input.substr(0, end);
+		client.input.erase(0, end + 1);
+		handleControlLine(client, line);
+	}
+}
+
+//Reads what the client sent and runs the complete lines. Nothing is read
+//while the client does not read its replies. Returns false once the
+//client has gone.
+bool readControlClient(ControlClient &client)
+{
+	char buffer[4096];
+	while (client.output.size() < MAX_CONTROL_OUTPUT)
+	{
+		ssize_t received = recv(client.fd, buffer, sizeof(buffer), 0);
+		if (received == 0)
+			return false;
+		if (received < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		client.input.append(buffer, received);
+		runControlLines(client);
+		if (client.input.size() > MAX_CONTROL_OUTPUT)
+			return false;
+	}
+	return true;
+}
+
+//Sends as much of the pending output as the socket takes. Returns false
+//if the client has gone.
+bool flushControlClient(ControlClient &client)
+{
+	while (!client.output.empty())
+	{
+		ssize_t sent = send(client.fd, client.output.data(), client.output.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		client.output.erase(0, sent);
+	}
+	return true;
+}
+
+void serveControl(void)
+{
+	std::vector<pollfd> fds;
+	while (control.running)
+	{
+		//Wake up for the next position update that is due, and now and
+		//then to notice the shutdown.
+		double now = nowMs(), timeout = 100.0;
+		fds.clear();
+		pollfd listener = { control.fd, POLLIN, 0 };
+		fds.push_back(listener);
+		for (size_t i = 0; i < control.clients.size(); i++)
+		{
+			const ControlClient &client = control.clients[i];
+			short events = (client.output.size() < MAX_CONTROL_OUTPUT ? POLLIN : 0) | (client.output.empty() ? 0 : POLLOUT);
+			pollfd entry = { client.fd, events, 0 };
+			fds.push_back(entry);
+			if (client.rate > 0.0)
+				timeout = std::min(timeout, std::max(0.0, client.nextUpdate - now));
+		}
+		if (poll(&fds[0], fds.size(), (int)ceil(timeout)) < 0 && errno != EINTR)
+		{
+			std::cerr << "Error: Control socket: " << strerror(errno) << std::endl;
+			break;
+		}
+
+		now = nowMs();
+		bool acquired = false;
+		for (size_t i = 0; i < control.clients.size(); )
+		{
+			ControlClient &client = control.clients[i];
+			bool alive = !(fds[i + 1].revents & (POLLERR | POLLNVAL));
+			if (alive && (fds[i + 1].revents & (POLLIN | POLLHUP)))
+				alive = readControlClient(client);
+			if (alive && client.rate > 0.0 && now >= client.nextUpdate)
+			{
+				if (!acquired)
+					telemetry.acquire();
+				acquired = true;
+				if (client.output.size() < MAX_CONTROL_OUTPUT)
+					appendPositions(telemetry.readSlot(), &client.output);
+				client.nextUpdate = std::max(client.nextUpdate + 1000.0 / client.rate, now);
+			}
+			if (alive)
+				alive = flushControlClient(client);
+			if (alive)
+			{
+				runControlLines(client);
+				i++;
+				continue;
+			}
+			close(client.fd);
+			control.clients.erase(control.clients.begin() + i);
+			fds.erase(fds.begin() + i + 1);
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			int fd = accept(control.fd, NULL, NULL);
+			if (fd >= 0)
+			{
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				ControlClient client = { fd, "", "", 0.0, 0.0 };
+				control.clients.push_back(client);
+			}
+		}
+	}
+	for (size_t i = 0; i < control.clients.size(); i++)
+		close(control.clients[i].fd);
+	control.clients.clear();
+}
+
+bool startControlServer(const std::string &address)
 {
-	saturn_x = 17.0f * cos(saturnOrbitAroundSun * 0.30f / 180.0 * PI);
-	saturn_y = 17.0f * sin(saturnOrbitAroundSun * 0.30f / 180.0 * PI);
-
-	if(saturnOrbitAroundSun == 0)
-		saturnOriginX = saturn_x;
-	if(saturn_x >= saturnOriginX)
-		saturnOrbitAroundSun = 0.0f;
-	glActiveTexture(GL_TEXTURE0);
-    glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[6]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glPushMatrix();
-	glTranslatef(saturn_x, 0, saturn_y);
-	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(90,1.0f,0.0f,0.0f);
-    glRotatef(saturnRotation,0.0f,0.0f,1.0f);
-	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 0.35, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
-	glPopMatrix();
-    glDisable(GL_TEXTURE_2D);
+	sockaddr_storage storage;
+	socklen_t length;
+	if (!controlAddress(address, &storage, &length))
+		return false;
+	control.fd = socket(storage.ss_family, SOCK_STREAM, 0);
+	if (control.fd < 0)
+	{
+		std::cerr << "Error: Could not create the control socket: " << strerror(errno) << std::endl;
+		return false;
+	}
+	if (storage.ss_family == AF_UNIX)
+	{
+		//Only replace a socket left behind by an earlier run, never
+		//anything else that happens to be at the path.
+		struct stat status;
+		if (lstat(address.c_str(), &status) == 0)
+		{
+			if (!S_ISSOCK(status.st_mode))
+			{
+				std::cerr << "Error: " << address << " exists and is not a socket" << std::endl;
+				close(control.fd);
+				control.fd = -1;
+				return false;
+			}
+			unlink(address.c_str());
+		}
+		control.path = address;
+	}
+	else
+	{
+		int reuse = 1;
+		setsockopt(control.fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	}
+	if (bind(control.fd, reinterpret_cast<sockaddr *>(&storage), length) != 0 || listen(control.fd, 8) != 0)
+	{
+		std::cerr << "Error: Could not listen on " << address << ": " << strerror(errno) << std::endl;
+		close(control.fd);
+		control.fd = -1;
+		return false;
+	}
+	fcntl(control.fd, F_SETFL, fcntl(control.fd, F_GETFL) | O_NONBLOCK);
+	for (int i = 0; i < NUM_BODIES; i++)
+		control.names[i] = bodies[i].name;
+	control.running = true;
+	control.thread = std::thread(serveControl);
+	std::cout << "Control socket listening on " << address << std::endl;
+	return true;
 }
 
-void drawUranus(void)
+void stopControlServer(void)
 {
-	uranus_x = 19.0f * cos(uranusOrbitAroundSun * 0.30f / 180.0 * PI);
-	uranus_y = 19.0f * sin(uranusOrbitAroundSun * 0.30f / 180.0 * PI);
-
-	if(uranusOrbitAroundSun == 0)
-		uranusOriginX = uranus_x;
-	if(uranus_x >= uranusOriginX)
-		uranusOrbitAroundSun = 0.0f;
-	glActiveTexture(GL_TEXTURE0);
-    glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[7]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glPushMatrix();
-	glTranslatef(uranus_x, 0, uranus_y);
-	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(90,1.0f,0.0f,0.0f);
-    glRotatef(uranusRotation,0.0f,0.0f,1.0f);
-	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 0.2, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
-	glPopMatrix();
-    glDisable(GL_TEXTURE_2D);
+	if (!control.running)
+		return;
+	control.running = false;
+	control.thread.join();
+	close(control.fd);
+	control.fd = -1;
+	if (!control.path.empty())
+		unlink(control.path.c_str());
 }
 
-void drawNeptune(void)
+//Applies the commands received since the last frame. Called by the GLUT
+//thread; never waits for the server. Like the body configuration, the
+//simulated time is only changed while no step is running, otherwise the
+//command waits for the next frame.
+void applyControlCommands(void)
 {
-	neptune_x = 21.0f * cos(neptuneOrbitAroundSun * 0.30f / 180.0 * PI);
-	neptune_y = 21.0f * sin(neptuneOrbitAroundSun * 0.30f / 180.0 * PI);
-
-	if(neptuneOrbitAroundSun == 0)
-		neptuneOriginX = neptune_x;
-	if(neptune_x >= neptuneOriginX)
-		neptuneOrbitAroundSun = 0.0f;
-	glActiveTexture(GL_TEXTURE0);
-    glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[8]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glPushMatrix();
-	glTranslatef(neptune_x, 0, neptune_y);
-	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(90,1.0f,0.0f,0.0f);
-    glRotatef(neptuneRotation,0.0f,0.0f,1.0f);
-	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 0.4, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
-	glPopMatrix();
-    glDisable(GL_TEXTURE_2D);
+	std::unique_lock<std::mutex> guard(controlQueue.lock, std::try_to_lock);
+	if (!guard.owns_lock())
+		return;
+	if (controlQueue.focus >= 0)
+	{
+		focusBody(controlQueue.focus);
+		controlQueue.focus = -1;
+	}
+	if (simulationInFlight)
+		return;
+	if (controlQueue.setTimeScale)
+	{
+		simulation.timeScale = controlQueue.timeScale;
+		controlQueue.setTimeScale = false;
+	}
+	if (controlQueue.seek)
+	{
+		simulation.time = controlQueue.seekDays / daysPerStep();
+		simulation.epoch++;
+		controlQueue.seek = false;
+	}
 }
 
-void drawMilkyWay(void) //Draw the skysphere of the Milky Way. 
+//Hands the state of the frame just drawn to the server. frameMs is the
+//time since the previous frame, negative for the first one.
+void publishTelemetry(const FrameState &frame, double frameMs)
 {
-	glActiveTexture(GL_TEXTURE0);
-    glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[9]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glPushMatrix();
-	glTranslatef(0, 0, 0);
-	glRotatef(7,1.0f,0.0f,0.0f);
-	glRotatef(0.0f,1.0f,0.0f,0.0f);
-	gluQuadricTexture(sun, 1);
-	gluSphere(sun, 40, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
-	glPopMatrix();
-    glDisable(GL_TEXTURE_2D);
+	static float history[Telemetry::HISTORY];
+	static long recorded = 0;
+	static long framesDrawn = 0;
+	if (frameMs >= 0.0)
+		history[recorded++ % Telemetry::HISTORY] = (float)frameMs;
+	framesDrawn++;
+	int numFrames = (int)std::min(recorded, (long)Telemetry::HISTORY);
+
+	Telemetry &snapshot = telemetry.writeSlot();
+	snapshot.frame = framesDrawn;
+	snapshot.step = frame.step;
+	snapshot.days = frame.time * daysPerStep();
+	snapshot.timeScale = simulation.timeScale;
+	snapshot.focus = camera.target;
+	std::copy(frame.position, frame.position + NUM_BODIES, snapshot.position);
+	for (int i = 0; i < numFrames; i++)
+		snapshot.frameMs[i] = history[(recorded - numFrames + i) % Telemetry::HISTORY];
+	snapshot.numFrames = numFrames;
+	snapshot.gpuMs = gpuTimer.frameMs;
+	snapshot.simulateMs = frame.simulateMs;
+	snapshot.latencyMs = nowMs() - frame.simulatedAt;
+	snapshot.renderScale = quality().scale;
+	telemetry.publish();
 }
 
-void drawParticles(void)
+//Test client for the control socket: sends the lines read from stdin and
+//prints what comes back. Exits when the server closes the connection, or
+//once stdin is closed and nothing has arrived for a second.
+int runControlClient(const std::string &address)
 {
-	glActiveTexture(GL_TEXTURE0);
-    glEnable (GL_TEXTURE_2D);
-    glBindTexture (GL_TEXTURE_2D, textures[10]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glPushMatrix();
-	
-	for (int i = 0; i < MAX_PARTICLES; i++)
+	sockaddr_storage storage;
+	socklen_t length;
+	if (!controlAddress(address, &storage, &length))
+		return EXIT_FAILURE;
+	int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&storage), length) != 0)
+	{
+		std::cerr << "Error: Could not connect to " << address << ": " << strerror(errno) << std::endl;
+		if (fd >= 0)
+			close(fd);
+		return EXIT_FAILURE;
+	}
+	bool input = true;
+	for (;;)
 	{
-		if(particle[i].active)
+		pollfd fds[2] = { { fd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+		int ready = poll(fds, input ? 2 : 1, input ? -1 : 1000);
+		if (ready < 0 && errno != EINTR)
+			break;
+		if (ready == 0)
+			break;
+		char buffer[4096];
+		if (fds[0].revents)
 		{
-			float x = particle[i].x;
-			float y = particle[i].y;
-			float z = particle[i].z;
-
-
-			glTranslatef(x, z, y);
-
-			gluQuadricTexture(sun, 1);
-			gluSphere(sun, 0.07, 45, 45); //Parameters -> (qobj, radius, slices, stacks)
-
-			//glBegin(GL_TRIANGLE_STRIP);						// Build Quad From A Triangle Strip
-			//    glTexCoord2d(1,1); glVertex3f(x+0.5f,y+0.5f,z); // Top Right
-			//	glTexCoord2d(0,1); glVertex3f(x-0.5f,y+0.5f,z); // Top Left
-			//	glTexCoord2d(1,0); glVertex3f(x+0.5f,y-0.5f,z); // Bottom Right
-			//	glTexCoord2d(0,0); glVertex3f(x-0.5f,y-0.5f,z); // Bottom Left
-			//glEnd();										// Done Building Triangle Strip
-
-			particle[i].x += 0.006;// Move On The X Axis By X Speed
-			//particle[i].y+=particle[i].yD/(slowdown*1000);// Move On The Y Axis By Y Speed
-			//particle[i].z+=particle[i].zD/(slowdown*1000);// Move On The Z Axis By Z Speed
-
-			particle[i].xD = particle[i].horizontalMovement;			// Take Pull On X Axis Into Account		// Take Pull On Z Axis Into Account
-			particle[i].life-=particle[i].fade;
-
-			if (particle[i].life<0.0f && particle[i].x > 40)					// If Particle Is Burned Out
-			{
-				particle[i].life=360.0f;					// Give It New Life
-				particle[i].fade= 0.053;              // Random Fade Value
-				particle[i].x = -20.0f;				// Center On X Axis
-				particle[i].y=  rand() % 61 - 30;		//Random number between -5 and 5
-				particle[i].z= rand() % 11 - 5;						// Center On Z Axis
-			}
+			ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+			if (received <= 0)
+				break;
+			fwrite(buffer, 1, received, stdout);
+			fflush(stdout);
+		}
+		if (input && fds[1].revents)
+		{
+			ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+			if (count <= 0)
+				input = false;
+			else if (send(fd, buffer, count, MSG_NOSIGNAL) != count)
+				break;
 		}
 	}
-	glPopMatrix();
-    glDisable(GL_TEXTURE_2D);
+	close(fd);
+	return EXIT_SUCCESS;
 }
 
-//End of drawing of astronomical objects.
-
-
-//Draw the whole model of the Solar System.
-void DisplayModel()
-{
-
-	//glLightModelfv(GL_LIGHT_MODEL_AMBIENT, LIGHT_MODEL_AMBIENT);	
-	//glEnable(GL_LIGHTING);
-	 // Define the model, view, and projection matrices here
- //   glm::mat4 model = glm::mat4(1.0f);
- //  glm::mat4 view = glm::mat4(1.0f);
- //glm::mat4 projection = glm::mat4(1.0f);
- // view = glm::lookAt(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0, 0.0, 0.0), glm::vec3(0.0, 1.0, 0.0)); //Z of first parameter is zoom.
- //  projection = glm::perspective(90.0f,(float)globals.width/globals.height, 0.1f, 100.0f);
-
- //   // Construct the ModelViewProjection, ModelView, and normal
- //   // matrices here and pass them as uniform variables to the shader
- //   // program
- //model = globals.trackball.getRotationMatrix() * model;
- //   glm::mat4 mvp = projection * view * model;
-	////globals.program.setUniformMatrix4fv("mvp",mvp);
- //   //globals.program.setUniformMatrix4fv("u_mv", (view * model));
- //   glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(view * model)));
-	drawSun();
-	drawMercury();
-	drawVenus();
-	drawEarth();
-	drawMars();
-	//drawJupiter();
-	drawSaturn();
-	drawUranus();
-	drawNeptune();
-
-	//glDisable(GL_LIGHTING);
-	//glutSwapBuffers();
-	//glFlush();
+//Draw the whole model of the Solar System, as far as the view sees it.
+void DisplayModel(const FrameState &frame, const ViewSet &set, const View &view)
+{
+	//The sky is centered on the camera and drawn first without depth
+	//writes, so it is always behind everything else.
+	if (view.sky)
+	{
+		glDepthMask(GL_FALSE);
+		drawSky();
+		glDepthMask(GL_TRUE);
+	}
+	for (int k = 0; k < set.numBodies; k++)
+	{
+		int i = set.bodyOrder[k];
+		if (!(set.objectMask[i] & set.bit(view)))
+			continue;
+		//The Sun is emissive and brighter than white, which is what
+		//makes it bloom.
+		if (i == SUN)
+		{
+			globals.sunProgram->enable();
+			globals.sunProgram->setUniform1i("u_texture", 0);
+			globals.sunProgram->setUniform1f("u_intensity", sunIntensity);
+		}
+		if (i < NUM_BODIES && view.terrain && !terrainDrawList[i].empty())
+			drawTerrain(frame.drawList[i], terrainDrawList[i]);
+		else
+			drawBody(frame.drawList[i]);
+		if (i == SUN)
+			globals.sunProgram->disable();
+	}
 }
 
 void initializeTrackball(void)
@@ -774,24 +5035,64 @@ void init(void)
     glClearColor(0.0, 0.0, 0.0, 1.0);
 	sun = gluNewQuadric();
 	LoadTextures(textureDir());
+	std::vector<BodyConfig> config;
+	BodyParams params[NUM_BODIES];
+	if (parseBodyConfig(getEnvVar("ASSIGNMENT3_ROOT") + "/bodies.cfg", &config) && mergeBodyConfig(config, params))
+		std::copy(params, params + NUM_BODIES, bodies);
+	initTerrain(textureDir());
 
 	//Initialize the particles.
+	simulation.seed = 1;
 	for (int i = 0; i < MAX_PARTICLES; i++)
 	{
-		particle[i].active = true;
-		particle[i].life=360.0f;					// Give It New Life
-		particle[i].fade= 0.053;              // Random Fade Value
-		particle[i].x = -20.0f;				// Center On X Axis
-		particle[i].y=  rand() % 61 - 30;		//Random number between -5 and 5
-		particle[i].z= rand() % 11 - 5;	    // Random Speed On Z Axis
-
-		particle[i].horizontalMovement = 0.5f;
-
+		simulation.particle[i].active = true;
+		respawnParticle(simulation.particle[i], &simulation.seed);
+		simulation.particle[i].x = rand_r(&simulation.seed) % 61 - 20; //Spread them out along the X axis.
+		simulation.particle[i].horizontalMovement = 0.5f;
 	}
+
+	//Simulate the first frame synchronously so that there is always a
+	//frame to draw.
+	jobs.start(std::max(1, (int)std::thread::hardware_concurrency() - 1));
+	stepSimulation(frameExchange.writeSlot());
+	frameExchange.publish();
+	frameExchange.acquire();
 	
     //gluQuadricTexture(sun, GL_TRUE);
     loadMesh((modelDir() + "bunny.obj"), &globals.mesh);
 
+    createShaderProgram(shaderDir() + "oit_accum.vert", shaderDir() + "oit_accum.frag",
+                        &globals.oitAccumProgram);
+    createShaderProgram(shaderDir() + "fullscreen.vert", shaderDir() + "oit_composite.frag",
+                        &globals.oitCompositeProgram);
+    createShaderProgram(shaderDir() + "oit_accum.vert", shaderDir() + "blend.frag",
+                        &globals.blendProgram);
+    createShaderProgram(shaderDir() + "trail.vert", shaderDir() + "trail.frag",
+                        &globals.trailProgram);
+    createShaderProgram(shaderDir() + "minor_planet.vert", shaderDir() + "minor_planet.frag",
+                        &globals.minorPlanetProgram);
+    createShaderProgram(shaderDir() + "star.vert", shaderDir() + "star.frag",
+                        &globals.starProgram);
+    createShaderProgram(shaderDir() + "fullscreen.vert", shaderDir() + "galactic_band.frag",
+                        &globals.galacticBandProgram);
+	createMinorPlanets(scenario);
+	createStarField(scenario);
+    createShaderProgram(shaderDir() + "sun.vert", shaderDir() + "sun.frag",
+                        &globals.sunProgram);
+    createShaderProgram(shaderDir() + "fullscreen.vert", shaderDir() + "bright.frag",
+                        &globals.brightProgram);
+    createShaderProgram(shaderDir() + "fullscreen.vert", shaderDir() + "bloom_down.frag",
+                        &globals.bloomDownProgram);
+    createShaderProgram(shaderDir() + "fullscreen.vert", shaderDir() + "bloom_up.frag",
+                        &globals.bloomUpProgram);
+    createShaderProgram(shaderDir() + "fullscreen.vert", shaderDir() + "tonemap.frag",
+                        &globals.tonemapProgram);
+	initGPUTimer();
+	frameArena.reserve(1 << 20);
+
+	createOrbits();
+	createTrails(&trails, NUM_BODIES + MAX_PARTICLES, 64);
+
     //std::string vshaderFilename = shaderDir() + "mesh.vert";
     //std::string fshaderFilename = shaderDir() + "mesh.frag";
     //createShaderProgram(vshaderFilename, fshaderFilename, &globals.program);
@@ -800,94 +5101,140 @@ void init(void)
     //createMeshVAO(globals.mesh, globals.program, &globals.meshVAO);
 
     initializeTrackball();
+	startFileWatcher();
 	
 }
 
 void display(void)
 {
+	double frameStart = nowMs();
+	long allocationsAtStart = threadHeapAllocations;
+	long totalAllocationsAtStart = heapAllocations.load(std::memory_order_relaxed);
+	insideFrame = true;
+	frameArena.reset();
 
-	//glViewport(0, 0, 1000, 1000);
-	//Works
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(90, 1000/(float)1000, 0.1, 100);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-	glm::mat4 model = glm::mat4(1.0f);
-	model = globals.trackball.getRotationMatrix();
-    gluLookAt(0, zoomFactor, 1, 0, 0, 0, 0.0, 1.0, 0);
-	
-	//gluLookAt(	x, 1.0f, z,
-	//	x+lx, 1.0f,  z+lz,
-	//	0.0f, 1.0f,  0.0f);
-
-
-	//glMatrixMode(GL_PROJECTION);
-	//glLoadIdentity();
-	//gluPerspective (90.0, 1000/(float)1000, 0.5, 100.0);
-	//glMatrixMode(GL_MODELVIEW);
- //   gluLookAt(0,0,-3,0,0,0,0,1,0);
+	if (exporter.active)
+	{
+		//Exactly one simulation step per exported frame.
+		while (simulationInFlight)
+			std::this_thread::yield();
+		fixedClockMs = exporter.issued * 1000.0 / exporter.fps;
+	}
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	//Pick up the newest simulated frame and start simulating the next one
+	//while this one is drawn.
+	if (frameExchange.acquire())
+		profiler.set("frames simulated", frameExchange.readSlot().step);
+	const FrameState &frame = frameExchange.readSlot();
+	applyReloads();
+	applyControlCommands();
+	kickSimulation();
+
+	updateCamera(frame);
+
+	resolveGPUTimer();
+	//The scene target shrinks with the governor's scale; the tonemap pass
+	//upscales it to the window.
+	resizeSceneTarget(&sceneTarget, std::max(1, int(globals.width * quality().scale)),
+	                  std::max(1, int(globals.height * quality().scale)));
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneTarget.fbo);
+	//Culls for all views; the terrain is selected for the main camera.
+	prepareViews(frame, sceneTarget.width, sceneTarget.height, &viewSet);
+	updateTerrain(frame);
+	updateTrails(frame);
+
+	beginStage(STAGE_SCENE);
     glEnable(GL_DEPTH_TEST); // ensures that polygons overlap correctly
-	drawSun();
-	drawMercury();
-	drawVenus();
-	drawEarth();
-	drawMars();
-	drawJupiter();
-	drawSaturn();
-	drawUranus();
-	drawNeptune();
-	drawMilkyWay();
-	drawParticles();
-	//DisplayModel();
+	glEnable(GL_SCISSOR_TEST);
+	for (int v = 0; v < viewSet.numViews; v++)
+	{
+		const View &view = viewSet.views[v];
+		applyViewport(view, sceneTarget.width, sceneTarget.height);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		DisplayModel(frame, viewSet, view);
+		if (showOrbits)
+			drawOrbits();
+		if (showTrails)
+			drawTrails(trails, *globals.trailProgram);
+		if (showMinorPlanets)
+			drawMinorPlanets(*globals.minorPlanetProgram, frame.time * daysPerStep());
+	}
     //drawMesh(globals.program, globals.meshVAO);
 	//TwDraw();
-	orbitAroundSun += 0.15f;
-
-
-	mercuryOrbitAroundSun += 0.06f;
-	venusOrbitAroundSun += 0.05f;
-	earthOrbitAroundSun += 0.07f;
-	marsOrbitAroundSun += 0.09f;
-	jupiterOrbitAroundSun += 0.10;
-	saturnOrbitAroundSun += 0.13;
-	uranusOrbitAroundSun += 0.15;
-	neptuneOrbitAroundSun += 0.17;
-
-	//Update the planets rotation.
-	//This is not accurate. The rotations are not correctly calculated in relation to Earth rotation time.
-	mercuryRotation += 0.07f;
-	venusRotation += 0.03f; //Venus' rotation is the slowest one from the solar system (243 Earth days).
-	earthRotation += 0.20f;
-	marsRotation += 0.22f;  //24.6 Earth hours.
-	jupiterRotation += 35.0f; //10 Earth hours. Fastest in the solar system.
-	saturnRotation += 14.0f;
-	uranusRotation += 10.0f;
-	neptuneRotation += 11.0f;
-
-	if(mercuryRotation > 360)
-		mercuryRotation = -360;
-	if(venusRotation > 360)
-		venusRotation = -360;
-	if(earthRotation > 360)
-		earthRotation = -360;
-	if(marsRotation > 360)
-		marsRotation = -360;
-	if(jupiterRotation > 360)
-		jupiterRotation = -360;
-	if(saturnRotation > 360)
-		saturnRotation = -360;
-	if(uranusRotation > 360)
-		uranusRotation = -360;
-	if(neptuneRotation > 360)
-		neptuneRotation = -360;
-	//if(orbitAroundSun > 360)
-	//	orbitAroundSun = 0;
-	//glDisable(GL_LIGHTING);
-    glutSwapBuffers();
+
+	endStage(STAGE_SCENE);
+
+	double transparentStart = nowMs();
+	beginStage(STAGE_TRANSPARENT);
+	size_t spriteBudget = size_t(frame.spriteList.size() * quality().particles);
+	const unsigned char *spriteMask = viewSet.objectMask + frame.drawList.size();
+	for (int v = 0; v < viewSet.numViews; v++)
+	{
+		const View &view = viewSet.views[v];
+		applyViewport(view, sceneTarget.width, sceneTarget.height);
+		drawTransparentOIT(frame.shellList, viewSet.shellMask,
+		                   frame.spriteList.empty() ? NULL : &frame.spriteList[0], spriteBudget,
+		                   spriteMask, viewSet.bit(view));
+	}
+	glDisable(GL_SCISSOR_TEST);
+	endStage(STAGE_TRANSPARENT);
+	profiler.set("transparent ms", nowMs() - transparentStart);
+
+	double postStart = nowMs();
+	glBindFramebuffer(GL_FRAMEBUFFER, exporter.active ? exporter.fbo : 0);
+	postProcess(sceneTarget, 0, 0, globals.width, globals.height);
+	profiler.set("post ms", nowMs() - postStart);
+	if (exporter.active)
+	{
+		exportFrame();
+		//Preview in the window.
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, exporter.fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, exporter.width, exporter.height, 0, 0, glutGet(GLUT_WINDOW_WIDTH),
+		                  glutGet(GLUT_WINDOW_HEIGHT), GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	double now = nowMs();
+	profiler.set("simulate ms", frame.simulateMs);
+	profiler.set("bvh refit ms", frame.bvhMs);
+	if (!frame.boundsCenter.empty())
+	{
+		static std::vector<int> nearby;
+		nearby.clear();
+		float range = bodies[camera.target].radius * 10.0f;
+		frame.bvh.queryRadius(&frame.boundsCenter[0], &frame.boundsRadius[0],
+		                      glm::vec3(frame.position[camera.target]), range, nearby);
+		profiler.set("objects near focus", nearby.size());
+	}
+	profiler.set("submit ms", now - frameStart);
+	profiler.set("render scale", quality().scale);
+	updateGovernor(std::max(now - frameStart, gpuTimer.frameMs));
+	profiler.set("frame latency ms", now - frame.simulatedAt);
+	sampleThreadUtilization();
+	profiler.set("heap allocs/frame", frameAllocations.glutThread);
+	profiler.set("heap allocs/frame all", frameAllocations.total);
+	profiler.set("heap live MB", heapLiveBytes.load(std::memory_order_relaxed) / (1024.0 * 1024.0));
+	profiler.set("frame arena KB", frameArena.highWater() / 1024.0);
+	drawProfiler();
+	if (hoveredObject >= 0)
+		drawText(8, 8, objectName(hoveredObject));
+	//The export is not paced by the display; the preview is shown now
+	//and then.
+	if (!exporter.active || exporter.issued % 30 == 0)
+		glutSwapBuffers();
+	else
+		glFlush();
 	//glfwSwapBuffers();
+	insideFrame = false;
+	frameAllocations.glutThread = threadHeapAllocations - allocationsAtStart;
+	frameAllocations.total = heapAllocations.load(std::memory_order_relaxed) - totalAllocationsAtStart;
+	if (control.running)
+	{
+		static double lastFrameStart = -1.0;
+		publishTelemetry(frame, lastFrameStart >= 0.0 ? frameStart - lastFrameStart : -1.0);
+		lastFrameStart = frameStart;
+	}
 }
 
 void reshape(int width, int height)
@@ -901,37 +5248,67 @@ void reshape(int width, int height)
 
 void keyboard(unsigned char key, int x, int y)
 {
-	float multiplier = 0.01f;
 	printf("User pressed the %c key\n", key); 
 	glutPostRedisplay();
+	if (key >= '0' && key < '0' + NUM_BODIES)
+	{
+		focusBody(key - '0');
+		return;
+	}
 	switch(key)
 	{
 	case 'a':
-		{
-			angle -= 0.01f;
-			lx = sin(angle);
-			lz = -cos(angle);
-		}	break;
-		
+		camera.yaw -= 0.05;
+		break;
 	case 'd':
-		{
-			angle += 0.01f;
-			lx = sin(angle);
-			lz = -cos(angle);
-			break;
-		}
+		camera.yaw += 0.05;
+		break;
+	case 'q':
+		camera.pitch = std::min(camera.pitch + 0.05, 1.5);
+		break;
+	case 'e':
+		camera.pitch = std::max(camera.pitch - 0.05, -1.5);
+		break;
 	case 's':
-		{
-			x -= lx * multiplier;
-			z -= lz * multiplier;
-			break;
-		}
+		camera.eye -= cameraForward() * camera.speed;
+		break;
 	case 'w':
-		{
-			x += lx * multiplier;
-			z += lz * multiplier;
-			break;
-		}
+		camera.eye += cameraForward() * camera.speed;
+		break;
+	case 'c':
+		toggleCameraMode();
+		break;
+	case 'p':
+		profiler.visible = !profiler.visible;
+		break;
+	case 'o':
+		showOrbits = !showOrbits;
+		break;
+	case 't':
+		showTrails = !showTrails;
+		break;
+	case 'g':
+		gammaCorrection = !gammaCorrection;
+		break;
+	case 'b':
+		bloomQuality = (bloomQuality + 1) % (MAX_BLOOM_LEVELS + 1);
+		std::cout << "Bloom quality: " << bloomQuality << " levels" << std::endl;
+		break;
+	case 'm':
+		showMinorPlanets = !showMinorPlanets;
+		break;
+	case 'k':
+		skyMode = SkyMode((skyMode + 1) % NUM_SKY_MODES);
+		break;
+	case 'v':
+		viewLayout = ViewLayout((viewLayout + 1) % NUM_LAYOUTS);
+		std::cout << "View layout: " << layoutNames[viewLayout] << std::endl;
+		break;
+	case 'r':
+		governor.enabled = !governor.enabled;
+		governor.samples = 0;
+		std::cout << "Resolution governor " << (governor.enabled ? "on" : "off") << std::endl;
+		break;
 	case 'i':
 		if(inverse == true)
 			inverse = false;
@@ -945,19 +5322,35 @@ void keyboard(unsigned char key, int x, int y)
 void mouseButtonPressed(int button, int x, int y)
 {
     if (button == GLUT_LEFT_BUTTON) {
+        pressPosition = glm::ivec2(x, y);
         globals.trackball.setCenter(glm::vec2(x, y));
         globals.trackball.startTracking(glm::vec2(x, y));
     }
-	if (button == 3 && zoomFactor != -38) //Clamp the value of zoomFactor between -38 and 38.
-		zoomFactor -= 1.00;
-	if (button == 4 && zoomFactor != 38)
-		zoomFactor += 1.00;
+	//The wheel zooms the orbit distance, or changes the speed in free mode.
+	//Zooming is multiplicative so that it works from planet surfaces out
+	//to the whole system.
+	double factor = (button == 3 ? 0.9 : (button == 4 ? 1.1 : 1.0));
+	if (camera.mode == CAMERA_ORBIT)
+	{
+		double minDistance = bodies[camera.target].radius * 1.05;
+		if (glm::length(camera.offset) * factor > minDistance)
+			camera.offset *= factor;
+	}
+	else
+		camera.speed *= factor;
 }
 
 void mouseButtonReleased(int button, int x, int y)
 {
     if (button == GLUT_LEFT_BUTTON) {
         globals.trackball.stopTracking();
+        //A click without dragging picks the object under the cursor and
+        //flies to it if it is a body.
+        if (abs(x - pressPosition.x) + abs(y - pressPosition.y) < 4) {
+            int object = pickObject(frameExchange.readSlot(), x, y);
+            if (object >= 0 && object < NUM_BODIES)
+                focusBody(object);
+        }
     }
 }
 
@@ -983,13 +5376,412 @@ void motion(int x, int y)
     moveTrackball(x, y);
 }
 
+void passiveMotion(int x, int y)
+{
+    hoveredObject = pickObject(frameExchange.readSlot(), x, y);
+}
+
 void idle(void)
 {
     glutPostRedisplay();
 }
 
+//Exports the given number of frames without the GLUT main loop, and
+//returns the sustained frame rate, or 0 if the export failed.
+double runExport(const std::string &path, int width, int height, int fps, long frames)
+{
+	int windowWidth = globals.width, windowHeight = globals.height;
+	bool governed = governor.enabled;
+	if (!startExport(path, width, height, fps, frames))
+		return 0.0;
+	globals.width = exporter.width;
+	globals.height = exporter.height;
+	governor.enabled = false; //Every frame at full quality.
+	while (exporter.issued < exporter.frames && !exportFailed())
+		display();
+	double rate = finishExport();
+	if (!exporter.error.empty())
+	{
+		std::cerr << "Error: " << exporter.error << std::endl;
+		rate = 0.0;
+	}
+	globals.width = windowWidth;
+	globals.height = windowHeight;
+	governor.enabled = governed;
+	fixedClockMs = -1.0;
+	return rate;
+}
+
+//BENCHMARKS
+//Binds the scene target and looks at the Sun from the default viewpoint.
+void setupBenchmarkView(void)
+{
+	resizeSceneTarget(&sceneTarget, globals.width, globals.height);
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneTarget.fbo);
+	glViewport(0, 0, globals.width, globals.height);
+	glEnable(GL_DEPTH_TEST);
+	camera.eye = glm::dvec3(0.0, -20.0, 1.0);
+	camera.center = glm::dvec3(0.0);
+	renderOrigin = camera.eye;
+	applyProjection(90.0, globals.width / (double)globals.height, 0.01, 0.0);
+	applyView(camera.center - camera.eye);
+}
+
+//Fills items with count random particle sprites spread over the system.
+void makeBenchmarkSprites(std::vector<DrawItem> &items, int count)
+{
+	unsigned int seed = 12345;
+	items.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		DrawItem &item = items[i];
+		item.texture = 10;
+		item.position = glm::dvec3(rand_r(&seed) % 4001 / 100.0 - 20.0,
+		                           rand_r(&seed) % 1001 / 100.0 - 5.0,
+		                           rand_r(&seed) % 4001 / 100.0 - 20.0);
+		item.tilt = 0.0f;
+		item.rotation = 0.0f;
+		item.radius = 0.07f + rand_r(&seed) % 100 / 1000.0f;
+		item.opacity = 0.2f + rand_r(&seed) % 80 / 100.0f;
+		item.generation = 0;
+	}
+}
+
+//Compares weighted blended OIT with CPU-sorted alpha blending at 10k and
+//100k transparent sprites. Run with --bench-oit.
+void benchmarkTransparency(void)
+{
+	const int counts[2] = { 10000, 100000 };
+	const int runs = 20;
+	std::vector<DrawItem> shuffled, items;
+	std::vector<DrawItem> noShells;
+
+	setupBenchmarkView();
+
+	for (int c = 0; c < 2; c++)
+	{
+		makeBenchmarkSprites(shuffled, counts[c]);
+		double sortedMs = 0.0, sortMs = 0.0, oitMs = 0.0;
+		for (int run = 0; run < runs; run++)
+		{
+			//The sorted path sorts in place; every run starts from the
+			//unsorted sprites.
+			items = shuffled;
+			glBindFramebuffer(GL_FRAMEBUFFER, sceneTarget.fbo);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glFinish();
+			double start = nowMs();
+			sortMs += drawTransparentSorted(items);
+			glFinish();
+			sortedMs += nowMs() - start;
+
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glFinish();
+			start = nowMs();
+			drawTransparentOIT(noShells, NULL, &shuffled[0], shuffled.size(), NULL, 0);
+			glFinish();
+			oitMs += nowMs() - start;
+		}
+		std::cout << counts[c] << " transparent sprites: sorted blending "
+		          << sortedMs / runs << " ms (sort " << sortMs / runs << " ms), weighted blended OIT "
+		          << oitMs / runs << " ms" << std::endl;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+//Streams and draws 100k trails of 64 positions each. Run with
+//--bench-trails.
+void benchmarkTrails(void)
+{
+	const int numTrails = 100000;
+	const int frames = 200;
+	TrailBuffer bench;
+	createTrails(&bench, numTrails, 64);
+	std::vector<glm::vec3> positions(numTrails);
+
+	setupBenchmarkView();
+
+	double uploadMs = 0.0, drawMs = 0.0;
+	for (int frame = 0; frame < frames; frame++)
+	{
+		for (int i = 0; i < numTrails; i++)
+		{
+			float radius = 4.0f + 18.0f * i / numTrails;
+			float angle = frame * 0.01f + i * 0.61803f;
+			positions[i] = glm::vec3(radius * cos(angle), (i % 100) * 0.01f - 0.5f, radius * sin(angle));
+		}
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glFinish();
+		double start = nowMs();
+		pushTrails(&bench, &positions[0], glm::dvec3(0.0), NULL, numTrails);
+		glFinish();
+		double uploaded = nowMs();
+		drawTrails(bench, *globals.trailProgram);
+		glFinish();
+		uploadMs += uploaded - start;
+		drawMs += nowMs() - uploaded;
+	}
+	std::cout << numTrails << " trails of " << bench.length << " positions: upload "
+	          << uploadMs / frames << " ms, draw " << drawMs / frames << " ms per frame" << std::endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+//Builds, refits and queries a BVH over 1M spheres in a belt around the
+//Sun. Run with --bench-bvh.
+void benchmarkBVH(void)
+{
+	const int count = 1000000;
+	const int queries = 100000;
+	std::vector<glm::vec3> centers(count);
+	std::vector<float> radii(count);
+	std::vector<float> angles(count), distances(count);
+	unsigned int seed = 4711;
+	for (int i = 0; i < count; i++)
+	{
+		angles[i] = rand_r(&seed) % 36000 / 18000.0f * 3.14159265f;
+		distances[i] = 12.0f + rand_r(&seed) % 3000 / 1000.0f;
+		centers[i] = glm::vec3(distances[i] * cos(angles[i]), rand_r(&seed) % 1000 / 1000.0f - 0.5f,
+		                       distances[i] * sin(angles[i]));
+		radii[i] = 0.001f + rand_r(&seed) % 100 / 100000.0f;
+	}
+
+	SphereBVH bvh;
+	double start = nowMs();
+	bvh.build(&centers[0], &radii[0], count);
+	double buildMs = nowMs() - start;
+
+	//One simulation step: every object moves a little along its orbit.
+	for (int i = 0; i < count; i++)
+	{
+		float angle = angles[i] + 0.01f / distances[i];
+		centers[i] = glm::vec3(distances[i] * cos(angle), centers[i].y, distances[i] * sin(angle));
+	}
+	start = nowMs();
+	bvh.update(&centers[0], &radii[0], count);
+	double refitMs = nowMs() - start;
+
+	int hits = 0;
+	start = nowMs();
+	for (int q = 0; q < queries; q++)
+	{
+		glm::vec3 origin(0.0f, 20.0f, 0.0f);
+		glm::vec3 target = centers[rand_r(&seed) % count];
+		if (bvh.raycast(&centers[0], &radii[0], origin, glm::normalize(target - origin), NULL) >= 0)
+			hits++;
+	}
+	double rayUs = (nowMs() - start) * 1000.0 / queries;
+
+	std::vector<int> found;
+	size_t total = 0;
+	start = nowMs();
+	for (int q = 0; q < queries; q++)
+	{
+		found.clear();
+		bvh.queryRadius(&centers[0], &radii[0], centers[rand_r(&seed) % count], 0.05f, found);
+		total += found.size();
+	}
+	double radiusUs = (nowMs() - start) * 1000.0 / queries;
+
+	std::cout << count << " spheres: build " << buildMs << " ms, refit " << refitMs << " ms, ray pick "
+	          << rayUs << " us (" << hits << "/" << queries << " hits), radius query " << radiusUs
+	          << " us (" << total / (double)queries << " results)" << std::endl;
+}
+
+//Writes and loads a scenario with count random stars for the benchmarks.
+bool makeBenchmarkStars(int count, Scenario *result)
+{
+	std::vector<float> arrays[NUM_SCENARIO_ARRAYS];
+	unsigned int seed = 2024;
+	for (int i = 0; i < count; i++)
+	{
+		float z = rand_r(&seed) % 20001 / 10000.0f - 1.0f;
+		float angle = rand_r(&seed) % 36000 / 18000.0f * 3.14159265f;
+		float r = sqrt(1.0f - z * z);
+		arrays[STAR_X].push_back(r * cos(angle));
+		arrays[STAR_Y].push_back(z);
+		arrays[STAR_Z].push_back(r * sin(angle));
+		//The number of stars grows by about 10^0.5 per magnitude.
+		float u = (rand_r(&seed) % 1000000 + 1) / 1000000.0f;
+		arrays[STAR_MAGNITUDE].push_back(std::max(-1.5f, 10.0f + 2.0f * log10f(u)));
+		arrays[STAR_COLOR_INDEX].push_back(rand_r(&seed) % 200 / 100.0f - 0.3f);
+	}
+	sortStars(arrays);
+	const std::string filename = "/tmp/bench_stars.scn";
+	return writeScenario(filename, arrays) && loadScenario(filename, result);
+}
+
+//Compares the sky sphere with the star field at 100k and 1M stars, with
+//and without the galactic band. Run with --bench-sky.
+void benchmarkSky(void)
+{
+	const int counts[2] = { 100000, 1000000 };
+	const int runs = 50;
+	setupBenchmarkView();
+	ScenarioBuffer saved = starField;
+	for (int c = -1; c < 2; c++)
+	{
+		Scenario stars;
+		if (c >= 0)
+		{
+			if (!makeBenchmarkStars(counts[c], &stars))
+				return;
+			createStarField(stars);
+		}
+		const char *names[3] = { "sky sphere", "stars", "stars and galactic band" };
+		for (int mode = (c < 0 ? SKY_SPHERE : SKY_STARS); mode <= (c < 0 ? SKY_SPHERE : SKY_STARS_AND_BAND); mode++)
+		{
+			skyMode = SkyMode(mode);
+			double total = 0.0;
+			for (int run = 0; run < runs; run++)
+			{
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				glFinish();
+				double start = nowMs();
+				glDepthMask(GL_FALSE);
+				drawSky();
+				glDepthMask(GL_TRUE);
+				glFinish();
+				total += nowMs() - start;
+			}
+			std::cout << names[mode];
+			if (c >= 0)
+				std::cout << " (" << counts[c] << " stars)";
+			std::cout << ": " << total / runs << " ms" << std::endl;
+		}
+		if (c >= 0)
+		{
+			glDeleteBuffers(1, &starField.vbo);
+			munmap((void *)stars.data, stars.size);
+		}
+	}
+	starField = saved;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+//Exports 120 frames at 1080p and 4K, as PNG sequences and as Y4M, and
+//reports the sustained rate. Run with --bench-export.
+void benchmarkExport(void)
+{
+	const int sizes[2][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	const int frames = 120;
+	for (int s = 0; s < 2; s++)
+		for (int format = 0; format < 2; format++)
+		{
+			std::ostringstream path;
+			path << "/tmp/export_" << sizes[s][0] << "x" << sizes[s][1] << (format ? ".y4m" : "");
+			double rate = runExport(path.str(), sizes[s][0], sizes[s][1], 60, frames);
+			std::cout << sizes[s][0] << "x" << sizes[s][1] << (format ? " Y4M: " : " PNG: ") << rate
+			          << " frames/s sustained over " << frames << " frames" << std::endl;
+		}
+}
+
+//Resident and peak resident memory of the process in MB.
+double residentMB(void)
+{
+	long pages = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm != NULL) {
+		if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(statm);
+	}
+	return resident * (double)getpagesize() / (1024.0 * 1024.0);
+}
+
+double peakResidentMB(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+}
+
+//Converts a synthetic MPCORB catalog of 1M main belt asteroids, then
+//maps it and uploads it. Run with --bench-scenario.
+void benchmarkScenario(void)
+{
+	const int count = 1000000;
+	const std::string text = "/tmp/bench_mpcorb.dat", binary = "/tmp/bench_scenario.scn";
+	FILE *file = fopen(text.c_str(), "w");
+	if (file == NULL) {
+		std::cerr << "Error: Could not write " << text << "." << std::endl;
+		return;
+	}
+	unsigned int seed = 4711;
+	for (int i = 0; i < count; i++) {
+		float a = 2.1f + rand_r(&seed) % 12000 / 10000.0f;
+		fprintf(file, "%07d %5.2f %5.2f K24AH %9.5f  %9.5f  %9.5f  %9.5f  %9.7f %11.8f %11.7f  0 MPO000000\n",
+		        i, 12.0f + rand_r(&seed) % 800 / 100.0f, 0.15f, rand_r(&seed) % 36000 / 100.0f,
+		        rand_r(&seed) % 36000 / 100.0f, rand_r(&seed) % 36000 / 100.0f, rand_r(&seed) % 2000 / 100.0f,
+		        rand_r(&seed) % 3000 / 10000.0f, EARTH_MEAN_MOTION / pow(a, 1.5f), a);
+	}
+	fclose(file);
+
+	double residentBefore = residentMB();
+	double start = nowMs();
+	if (!convertScenario(text, "", binary))
+		return;
+	double convertMs = nowMs() - start;
+	double convertPeak = peakResidentMB();
+
+	Scenario bench;
+	residentBefore = residentMB();
+	start = nowMs();
+	if (!loadScenario(binary, &bench))
+		return;
+	double loadMs = nowMs() - start;
+
+	//Touching every element faults the pages in.
+	start = nowMs();
+	float sum = 0.0f;
+	for (size_t i = 0; i < bench.minor.count; i++)
+		sum += bench.minor.semiMajorAxis[i] + bench.minor.magnitude[i];
+	double touchMs = nowMs() - start;
+	double residentMapped = residentMB();
+
+	ScenarioBuffer saved = minorPlanets;
+	start = nowMs();
+	createMinorPlanets(bench);
+	glFinish();
+	double uploadMs = nowMs() - start;
+	glDeleteBuffers(1, &minorPlanets.vbo);
+	minorPlanets = saved;
+
+	std::cout << count << " minor planets (" << bench.size / (1024.0 * 1024.0) << " MB file): convert "
+	          << convertMs << " ms (peak " << convertPeak << " MB), map and validate " << loadMs
+	          << " ms, first touch " << touchMs << " ms (+" << residentMapped - residentBefore
+	          << " MB resident, checksum " << sum << "), GPU upload " << uploadMs << " ms, peak resident "
+	          << peakResidentMB() << " MB" << std::endl;
+	munmap((void *)bench.data, bench.size);
+}
+
+//Joins the job system threads when GLUT exits the process.
+void shutdown(void)
+{
+	stopControlServer();
+	stopFileWatcher();
+	while (simulationInFlight)
+		std::this_thread::yield();
+	jobs.stop();
+}
+
 int main(int argc, char** argv)
 {
+	//Options that have to be handled before the window is created.
+	std::string minorPlanetFile, starFile;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--minor-planets" && i + 1 < argc)
+			minorPlanetFile = argv[++i];
+		else if (arg == "--stars" && i + 1 < argc)
+			starFile = argv[++i];
+		else if (arg == "--convert-scenario" && i + 1 < argc)
+			exit(convertScenario(minorPlanetFile, starFile, argv[++i]) ? EXIT_SUCCESS : EXIT_FAILURE);
+		else if (arg == "--scenario" && i + 1 < argc && !loadScenario(argv[++i], &scenario))
+			exit(EXIT_FAILURE);
+		else if (arg == "--control-client" && i + 1 < argc)
+			exit(runControlClient(argv[++i]));
+	}
+
     glutInit(&argc, argv);
     globals.width = 1000;
     globals.height = 1000;
@@ -998,12 +5790,77 @@ int main(int argc, char** argv)
     glutCreateWindow("Model viewer");
     initGLEW();
     displayOpenGLVersion();
+    initDepth();
     init();
+	atexit(shutdown);
+	std::string exportPath;
+	int exportWidth = 1920, exportHeight = 1080, exportFps = 60;
+	long exportFrames = 600;
+	for (int i = 1; i < argc; i++) {
+		if (std::string(argv[i]) == "--bench-oit") {
+			benchmarkTransparency();
+			exit(EXIT_SUCCESS);
+		}
+		if (std::string(argv[i]) == "--bench-bvh") {
+			benchmarkBVH();
+			exit(EXIT_SUCCESS);
+		}
+		if (std::string(argv[i]) == "--export" && i + 1 < argc)
+			exportPath = argv[++i];
+		if (std::string(argv[i]) == "--export-size" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &exportWidth, &exportHeight);
+		if (std::string(argv[i]) == "--export-fps" && i + 1 < argc)
+			exportFps = std::max(1, atoi(argv[++i]));
+		if (std::string(argv[i]) == "--export-frames" && i + 1 < argc)
+			exportFrames = atol(argv[++i]);
+		if (std::string(argv[i]) == "--bench-export") {
+			benchmarkExport();
+			exit(EXIT_SUCCESS);
+		}
+		if (std::string(argv[i]) == "--bench-sky") {
+			benchmarkSky();
+			exit(EXIT_SUCCESS);
+		}
+		if (std::string(argv[i]) == "--bench-scenario") {
+			benchmarkScenario();
+			exit(EXIT_SUCCESS);
+		}
+		if (std::string(argv[i]) == "--bench-trails") {
+			benchmarkTrails();
+			exit(EXIT_SUCCESS);
+		}
+		if (std::string(argv[i]) == "--target-ms" && i + 1 < argc)
+			governor.targetMs = atof(argv[++i]);
+		if (std::string(argv[i]) == "--governor-log" && i + 1 < argc)
+			governor.logPath = argv[++i];
+		if (std::string(argv[i]) == "--bloom-quality" && i + 1 < argc)
+			bloomQuality = std::max(0, std::min(atoi(argv[++i]), MAX_BLOOM_LEVELS));
+		if (std::string(argv[i]) == "--trace-allocations")
+			heapHook = traceFrameAllocation;
+		if (std::string(argv[i]) == "--views" && i + 1 < argc) {
+			std::string name = argv[++i];
+			for (int layout = 0; layout < NUM_LAYOUTS; layout++)
+				if (name == layoutNames[layout])
+					viewLayout = ViewLayout(layout);
+		}
+		if (std::string(argv[i]) == "--stereo-separation" && i + 1 < argc)
+			stereoSeparation = (float)atof(argv[++i]);
+		if (std::string(argv[i]) == "--control" && i + 1 < argc && !startControlServer(argv[++i]))
+			exit(EXIT_FAILURE);
+	}
+	if (!exportPath.empty()) {
+		double rate = runExport(exportPath, exportWidth, exportHeight, exportFps, exportFrames);
+		if (rate <= 0.0)
+			exit(EXIT_FAILURE);
+		std::cout << "Exported " << exportFrames << " frames at " << rate << " frames/s." << std::endl;
+		exit(EXIT_SUCCESS);
+	}
     glutReshapeFunc(&reshape);
     glutDisplayFunc(&display);
 	glutKeyboardFunc(&keyboard);
     glutMouseFunc(&mouse);
     glutMotionFunc(&motion);
+    glutPassiveMotionFunc(&passiveMotion);
     glutIdleFunc(&idle);
     glutMainLoop();
 
@@ -0,0 +1,20 @@
+// Fragment shader
+#version 130
+
+// Plain alpha blending of a transparent surface. Used as the sorted
+// reference path for the OIT benchmark.
+
+uniform sampler2D u_texture;
+uniform float u_alphaFromLuminance;
+
+in vec2 v_texcoord;
+in float v_depth;
+in float v_opacity;
+
+void main() {
+    vec4 color = texture(u_texture, v_texcoord);
+    float luminance = dot(color.rgb, vec3(0.299, 0.587, 0.114));
+    float alpha = mix(color.a, luminance, u_alphaFromLuminance) * v_opacity;
+
+    gl_FragColor = vec4(color.rgb, alpha);
+}
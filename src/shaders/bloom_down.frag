@@ -0,0 +1,20 @@
+// Fragment shader
+#version 130
+
+// Dual filter downsample (Bjorge, "Bandwidth-Efficient Rendering",
+// SIGGRAPH 2015): five bilinear taps, the center weighted four times.
+
+uniform sampler2D u_source;
+uniform vec2 u_halfPixel;   // Half a texel of the source level
+
+in vec2 v_texcoord;
+
+void main() {
+    vec3 sum = texture(u_source, v_texcoord).rgb * 4.0;
+    sum += texture(u_source, v_texcoord - u_halfPixel).rgb;
+    sum += texture(u_source, v_texcoord + u_halfPixel).rgb;
+    sum += texture(u_source, v_texcoord + vec2(u_halfPixel.x, -u_halfPixel.y)).rgb;
+    sum += texture(u_source, v_texcoord - vec2(u_halfPixel.x, -u_halfPixel.y)).rgb;
+
+    gl_FragColor = vec4(sum / 8.0, 1.0);
+}
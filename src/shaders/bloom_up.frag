@@ -0,0 +1,24 @@
+// Fragment shader
+#version 130
+
+// Dual filter upsample: eight bilinear taps in a tent around the pixel.
+// Added onto the next larger level with additive blending.
+
+uniform sampler2D u_source;
+uniform vec2 u_halfPixel;   // Half a texel of the source level
+
+in vec2 v_texcoord;
+
+void main() {
+    vec2 h = u_halfPixel;
+    vec3 sum = texture(u_source, v_texcoord + vec2(-h.x * 2.0, 0.0)).rgb;
+    sum += texture(u_source, v_texcoord + vec2(-h.x, h.y)).rgb * 2.0;
+    sum += texture(u_source, v_texcoord + vec2(0.0, h.y * 2.0)).rgb;
+    sum += texture(u_source, v_texcoord + vec2(h.x, h.y)).rgb * 2.0;
+    sum += texture(u_source, v_texcoord + vec2(h.x * 2.0, 0.0)).rgb;
+    sum += texture(u_source, v_texcoord + vec2(h.x, -h.y)).rgb * 2.0;
+    sum += texture(u_source, v_texcoord + vec2(0.0, -h.y * 2.0)).rgb;
+    sum += texture(u_source, v_texcoord + vec2(-h.x, -h.y)).rgb * 2.0;
+
+    gl_FragColor = vec4(sum / 12.0, 1.0);
+}
@@ -0,0 +1,21 @@
+// Fragment shader
+#version 130
+
+// Bright pass: keeps what is above the threshold, with a soft knee so
+// that the bloom does not switch on abruptly.
+
+uniform sampler2D u_scene;
+uniform float u_threshold;
+uniform float u_knee;
+
+in vec2 v_texcoord;
+
+void main() {
+    vec3 color = texture(u_scene, v_texcoord).rgb;
+    float brightness = max(color.r, max(color.g, color.b));
+    float soft = clamp(brightness - u_threshold + u_knee, 0.0, 2.0 * u_knee);
+    soft = soft * soft / (4.0 * u_knee + 1e-5);
+    float weight = max(soft, brightness - u_threshold) / max(brightness, 1e-5);
+
+    gl_FragColor = vec4(color * weight, 1.0);
+}
@@ -0,0 +1,13 @@
+// Vertex shader
+#version 130
+
+// Full-screen triangle generated from gl_VertexID, drawn with
+// glDrawArrays(GL_TRIANGLES, 0, 3).
+
+out vec2 v_texcoord;
+
+void main() {
+    vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    v_texcoord = position;
+    gl_Position = vec4(position * 2.0 - 1.0, 0.0, 1.0);
+}
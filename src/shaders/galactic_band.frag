@@ -0,0 +1,40 @@
+// Fragment shader
+#version 130
+
+// Background glow of the galactic band behind the star field. The view
+// ray of each pixel is turned into galactic coordinates and looked up in
+// a low-resolution panorama in galactic longitude and latitude (the
+// Milky Way texture, downsampled so that its baked-in stars blur into
+// the unresolved glow).
+
+uniform sampler2D u_texture;
+// Inverse of the projection and the view rotation.
+uniform mat4 u_inverseViewProjection;
+uniform float u_brightness;
+
+in vec2 v_texcoord;
+
+const float PI = 3.14159265;
+const float OBLIQUITY = 0.40909280; // 23.4393 degrees
+
+void main() {
+    vec4 point = u_inverseViewProjection * vec4(v_texcoord * 2.0 - 1.0, 0.5, 1.0);
+    vec3 scene = normalize(point.xyz / point.w);
+
+    // The orbital plane of the scene is x-z, so the ecliptic pole is y.
+    vec3 ecliptic = vec3(scene.x, scene.z, scene.y);
+    vec3 equatorial = vec3(ecliptic.x,
+                           ecliptic.y * cos(OBLIQUITY) - ecliptic.z * sin(OBLIQUITY),
+                           ecliptic.y * sin(OBLIQUITY) + ecliptic.z * cos(OBLIQUITY));
+    // J2000 equatorial to galactic rotation.
+    vec3 galactic = vec3(dot(vec3(-0.0548756, -0.8734371, -0.4838350), equatorial),
+                         dot(vec3( 0.4941094, -0.4448296,  0.7469822), equatorial),
+                         dot(vec3(-0.8676661, -0.1980764,  0.4559838), equatorial));
+
+    // The panorama has the galactic center in the middle, longitude
+    // growing to the left and north up.
+    float longitude = atan(galactic.y, galactic.x);
+    float latitude = asin(clamp(galactic.z, -1.0, 1.0));
+    vec2 texcoord = vec2(0.5 - longitude / (2.0 * PI), 0.5 - latitude / PI);
+    gl_FragColor = vec4(texture(u_texture, texcoord).rgb * u_brightness, 1.0);
+}
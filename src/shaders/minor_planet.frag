@@ -0,0 +1,12 @@
+// Fragment shader
+#version 130
+
+in float v_brightness;
+
+void main() {
+    // Round points.
+    vec2 offset = gl_PointCoord * 2.0 - 1.0;
+    if (dot(offset, offset) > 1.0)
+        discard;
+    gl_FragColor = vec4(vec3(0.8, 0.75, 0.65) * v_brightness, 1.0);
+}
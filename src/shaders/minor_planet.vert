@@ -0,0 +1,65 @@
+// Vertex shader
+#version 130
+
+// Each vertex is a minor planet given by its orbital elements. The
+// position at u_days is solved here from Kepler's equation, so the
+// elements are uploaded once and stay on the GPU.
+
+uniform float u_days;
+// Distances from the Sun are mapped piecewise linearly from AU to the
+// compressed scale of the scene, with the planets as the knots (the Sun
+// first).
+uniform float u_knotAU[9];
+uniform float u_knotScene[9];
+// Render origin as a high and a low part; subtracting them one after the
+// other keeps the precision of the double origin near the camera.
+uniform vec3 u_originHigh;
+uniform vec3 u_originLow;
+
+in float a_semiMajorAxis;
+in float a_eccentricity;
+in float a_inclination;
+in float a_node;
+in float a_periapsis;
+in float a_meanAnomaly;
+in float a_meanMotion;
+in float a_magnitude;
+
+out float v_brightness;
+
+float sceneDistance(float r) {
+    for (int i = 1; i < 9; i++) {
+        if (r < u_knotAU[i] || i == 8) {
+            float t = (r - u_knotAU[i - 1]) / (u_knotAU[i] - u_knotAU[i - 1]);
+            return mix(u_knotScene[i - 1], u_knotScene[i], t);
+        }
+    }
+    return r;
+}
+
+void main() {
+    float e = a_eccentricity;
+    float M = radians(mod(a_meanAnomaly + a_meanMotion * u_days, 360.0));
+    float E = e < 0.8 ? M : 3.14159265;
+    for (int i = 0; i < 6; i++)
+        E -= (E - e * sin(E) - M) / (1.0 - e * cos(E));
+    float x = a_semiMajorAxis * (cos(E) - e);
+    float y = a_semiMajorAxis * sqrt(1.0 - e * e) * sin(E);
+
+    // From the orbital plane to ecliptic coordinates.
+    float cw = cos(radians(a_periapsis)), sw = sin(radians(a_periapsis));
+    float cn = cos(radians(a_node)), sn = sin(radians(a_node));
+    float ci = cos(radians(a_inclination)), si = sin(radians(a_inclination));
+    vec3 ecliptic = vec3((cn * cw - sn * sw * ci) * x - (cn * sw + sn * cw * ci) * y,
+                         (sn * cw + cn * sw * ci) * x - (sn * sw - cn * cw * ci) * y,
+                         sw * si * x + cw * si * y);
+    float r = length(ecliptic);
+    ecliptic *= sceneDistance(r) / max(r, 1e-6);
+
+    // Bright (low magnitude) bodies are larger and brighter.
+    v_brightness = clamp(exp2((16.0 - a_magnitude) * 0.4), 0.15, 1.0);
+    gl_PointSize = clamp(1.0 + (14.0 - a_magnitude) * 0.5, 1.0, 4.0);
+    // The orbital plane of the scene is x-z.
+    vec3 position = vec3(ecliptic.x, ecliptic.z, ecliptic.y);
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(position - u_originHigh - u_originLow, 1.0);
+}
@@ -0,0 +1,27 @@
+// Fragment shader
+#version 130
+
+// Weighted blended order-independent transparency (McGuire and Bavoil
+// 2013). Writes the weighted premultiplied color to the accumulation
+// target and the coverage to the revealage target.
+
+uniform sampler2D u_texture;
+// 1.0 if the texture has no alpha channel and the alpha should be taken
+// from the luminance instead (clouds, atmosphere, particles).
+uniform float u_alphaFromLuminance;
+
+in vec2 v_texcoord;
+in float v_depth;
+in float v_opacity;
+
+void main() {
+    vec4 color = texture(u_texture, v_texcoord);
+    float luminance = dot(color.rgb, vec3(0.299, 0.587, 0.114));
+    float alpha = mix(color.a, luminance, u_alphaFromLuminance) * v_opacity;
+
+    // Depth weight, equation (9) of the paper
+    float w = clamp(10.0 / (1e-5 + pow(v_depth / 5.0, 2.0) + pow(v_depth / 200.0, 6.0)), 1e-2, 3e3);
+
+    gl_FragData[0] = vec4(color.rgb * alpha, alpha) * w;
+    gl_FragData[1] = vec4(alpha);
+}
@@ -0,0 +1,21 @@
+// Vertex shader
+#version 130
+
+// Transparent surfaces are drawn with the fixed-function matrices and
+// texture coordinates (gluSphere shells and particle sprites). The
+// opacity of each surface comes in through the vertex color alpha.
+
+out vec2 v_texcoord;
+out float v_depth;
+out float v_opacity;
+
+void main() {
+    vec4 position_eye = gl_ModelViewMatrix * gl_Vertex;
+
+    // Distance along the view direction, used for the OIT weight
+    v_depth = -position_eye.z;
+    v_texcoord = gl_MultiTexCoord0.xy;
+    v_opacity = gl_Color.a;
+
+    gl_Position = gl_ProjectionMatrix * position_eye;
+}
@@ -0,0 +1,22 @@
+// Fragment shader
+#version 130
+
+// Resolves the OIT targets over the opaque scene. Blended with
+// glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA). The targets are read
+// at the fragment's own pixel, so the pass can be limited to the viewport
+// of one view.
+
+uniform sampler2D u_accum;
+uniform sampler2D u_reveal;
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float reveal = texelFetch(u_reveal, pixel, 0).r;
+    if (reveal >= 1.0)
+        discard;
+
+    vec4 accum = texelFetch(u_accum, pixel, 0);
+    vec3 average = accum.rgb / max(accum.a, 1e-5);
+
+    gl_FragColor = vec4(average, reveal);
+}
@@ -0,0 +1,11 @@
+// Fragment shader
+#version 130
+
+in vec3 v_color;
+
+void main() {
+    // Gaussian falloff over the point; the stars are blended additively.
+    vec2 offset = gl_PointCoord * 2.0 - 1.0;
+    float falloff = exp(-3.0 * dot(offset, offset));
+    gl_FragColor = vec4(v_color * falloff * 1.6, 1.0);
+}
@@ -0,0 +1,41 @@
+// Vertex shader
+#version 130
+
+// Catalog stars as point sprites. The directions are drawn at infinity
+// (w = 0), so only the rotation of the view applies. Brighter stars get
+// larger points; the brightness is divided by the point area so that
+// the total light of a star follows its magnitude.
+
+// Magnitude of a star drawn as a single pixel at brightness u_brightness.
+uniform float u_limit;
+uniform float u_brightness;
+// Scene resolution relative to the window, to keep the size on screen.
+uniform float u_pixelScale;
+
+in float a_x;
+in float a_y;
+in float a_z;
+in float a_magnitude;
+in float a_colorIndex;
+
+out vec3 v_color;
+
+// Rough color of a star from its B-V color index.
+vec3 starColor(float bv) {
+    if (bv < 0.0)
+        return mix(vec3(0.61, 0.71, 1.0), vec3(0.8, 0.85, 1.0), clamp(bv / 0.4 + 1.0, 0.0, 1.0));
+    if (bv < 0.65)
+        return mix(vec3(0.8, 0.85, 1.0), vec3(1.0, 0.96, 0.9), bv / 0.65);
+    if (bv < 1.4)
+        return mix(vec3(1.0, 0.96, 0.9), vec3(1.0, 0.8, 0.6), (bv - 0.65) / 0.75);
+    return mix(vec3(1.0, 0.8, 0.6), vec3(1.0, 0.65, 0.4), clamp((bv - 1.4) / 0.6, 0.0, 1.0));
+}
+
+void main() {
+    // 10^(0.4 (limit - m)), the flux relative to a star at the limit.
+    float flux = exp2(1.3287712 * (u_limit - a_magnitude));
+    float size = clamp(1.0 + 0.6 * (u_limit - a_magnitude), 1.0, 7.0) * u_pixelScale;
+    gl_PointSize = max(size, 1.0);
+    v_color = starColor(a_colorIndex) * u_brightness * flux / max(size * size, 1.0);
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(a_x, a_y, a_z, 0.0);
+}
@@ -0,0 +1,12 @@
+// Fragment shader
+#version 130
+
+uniform sampler2D u_texture;
+// Brightness of the Sun relative to the other bodies.
+uniform float u_intensity;
+
+in vec2 v_texcoord;
+
+void main() {
+    gl_FragColor = vec4(texture(u_texture, v_texcoord).rgb * u_intensity, 1.0);
+}
@@ -0,0 +1,13 @@
+// Vertex shader
+#version 130
+
+// The Sun is drawn with the fixed-function matrices and texture
+// coordinates of gluSphere, but through its own shader so that it can
+// output HDR values.
+
+out vec2 v_texcoord;
+
+void main() {
+    v_texcoord = gl_MultiTexCoord0.xy;
+    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}
@@ -0,0 +1,30 @@
+// Fragment shader
+#version 130
+
+// Adds the bloom to the HDR scene, tonemaps it (ACES fit by Narkowicz)
+// and encodes the result for display.
+
+uniform sampler2D u_scene;
+uniform sampler2D u_bloom;
+uniform float u_bloomStrength;
+uniform float u_exposure;
+// 1.0 for sRGB output, 0.0 to write linear values (gamma correction off)
+uniform float u_srgb;
+
+in vec2 v_texcoord;
+
+vec3 aces(vec3 x) {
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+vec3 linearToSRGB(vec3 c) {
+    return mix(c * 12.92, 1.055 * pow(c, vec3(1.0 / 2.4)) - 0.055, step(0.0031308, c));
+}
+
+void main() {
+    vec3 color = texture(u_scene, v_texcoord).rgb;
+    color += texture(u_bloom, v_texcoord).rgb * u_bloomStrength;
+    color = aces(color * u_exposure);
+
+    gl_FragColor = vec4(mix(color, linearToSRGB(color), u_srgb), 1.0);
+}
@@ -0,0 +1,12 @@
+// Fragment shader
+#version 130
+
+// Additively blended, so the trails need no sorting.
+
+uniform vec3 u_color;
+
+in float v_fade;
+
+void main() {
+    gl_FragColor = vec4(u_color * v_fade, 1.0);
+}
@@ -0,0 +1,23 @@
+// Vertex shader
+#version 130
+
+// Trail vertices live in a ring buffer of u_length slots with u_numTrails
+// positions each, slot-major. The element buffer indexes it directly, so
+// gl_VertexID is the ring buffer index; the age of a vertex follows from
+// its slot and the newest slot u_head. Each slot is stored relative to
+// its own origin; u_slotOffset moves it to render space.
+
+uniform int u_numTrails;
+uniform int u_length;
+uniform int u_head;
+uniform vec3 u_slotOffset[64];
+
+out float v_fade;
+
+void main() {
+    int slot = gl_VertexID / u_numTrails;
+    int age = (u_head - slot + u_length) % u_length;
+    v_fade = 1.0 - float(age) / float(u_length - 1);
+
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(gl_Vertex.xyz + u_slotOffset[slot], 1.0);
+}